@@ -0,0 +1,320 @@
+// for SCHED_IDLE
+#define _GNU_SOURCE
+#include "archive.h"
+#include "flac.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static ma_uint64 cpuUs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (ma_uint64)ts.tv_sec * 1000000 + (ma_uint64)ts.tv_nsec / 1000;
+}
+
+// After every slice of CPU time, sleep long enough to bring this thread
+// down to `dutyPercent`
+static void throttle(ma_uint64 * sliceStart, ma_uint32 dutyPercent) {
+  if (dutyPercent >= 100) {
+    return;
+  }
+  ma_uint64 spent = cpuUs() - *sliceStart;
+  if (spent < ARCHIVE_SLICE_MS * 1000) {
+    return;
+  }
+  ma_uint64 rest = spent * (100 - dutyPercent) / dutyPercent;
+  struct timespec ts = { (time_t)(rest / 1000000), (long)(rest % 1000000) * 1000 };
+  nanosleep(&ts, NULL);
+  *sliceStart = cpuUs();
+}
+
+static ma_uint64 hashSamples(ma_uint64 hash, const ma_int32 * samples, size_t count) {
+  // FNV-1a, a sample at a time
+  for (size_t i = 0; i < count; i++) {
+    hash = (hash ^ (ma_uint32)samples[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+// Read up to a whole block, as the encoder only takes a short one at the end
+static ma_uint64 readBlock(ma_decoder * decoder, void * frames, ma_uint32 bytesPerFrame) {
+  ma_uint64 total = 0;
+  while (total < FLAC_BLOCK_FRAMES) {
+    ma_uint64 read = 0;
+    ma_decoder_read_pcm_frames(decoder, (char *)frames + total * bytesPerFrame, FLAC_BLOCK_FRAMES - total, &read);
+    if (read == 0) {
+      break;
+    }
+    total += read;
+  }
+  return total;
+}
+
+// s16 as is, f32 as 24-bit integers if that's what it holds
+static bool toIntegers(ma_format format, const void * in, ma_int32 * out, size_t count) {
+  if (format == ma_format_s16) {
+    for (size_t i = 0; i < count; i++) {
+      out[i] = ((const ma_int16 *)in)[i];
+    }
+    return true;
+  }
+  for (size_t i = 0; i < count; i++) {
+    float scaled = ((const float *)in)[i] * 8388608.0f;
+    if (!(scaled >= -8388608.0f && scaled <= 8388607.0f) || (float)(ma_int32)scaled != scaled) {
+      return false;
+    }
+    out[i] = (ma_int32)scaled;
+  }
+  return true;
+}
+
+static ma_uint64 fileBytes(const char * path) {
+  struct stat info;
+  return stat(path, &info) == 0 ? (ma_uint64)info.st_size : 0;
+}
+
+// Decode the FLAC back and hash it the way the take was hashed going in
+static ma_result verify(const char * path, ma_uint32 bitsPerSample, ma_uint64 frames, ma_uint64 hash, ma_int32 * samples, ma_uint32 dutyPercent, _Atomic bool * stop, ma_decoder_config config, ma_uint64 * sliceStart) {
+  ma_decoder decoder;
+  ma_uint64 total = 0;
+  ma_uint64 check = 1469598103934665603ull;
+  ma_result result = MA_SUCCESS;
+
+  config.format = ma_format_s32;
+  if (ma_decoder_init_file(path, &config, &decoder) != MA_SUCCESS) {
+    return MA_INVALID_DATA;
+  }
+  for (;;) {
+    ma_uint64 read = readBlock(&decoder, samples, decoder.outputChannels * sizeof(ma_int32));
+    if (read == 0) {
+      break;
+    }
+    // the decoder hands back samples scaled up to 32 bits
+    for (size_t i = 0; i < read * decoder.outputChannels; i++) {
+      samples[i] >>= 32 - bitsPerSample;
+    }
+    check = hashSamples(check, samples, read * decoder.outputChannels);
+    total += read;
+    throttle(sliceStart, dutyPercent);
+    if (stop != NULL && atomic_load(stop)) {
+      result = MA_CANCELLED;
+      break;
+    }
+  }
+  ma_decoder_uninit(&decoder);
+  if (result == MA_SUCCESS && (total != frames || check != hash)) {
+    result = MA_INVALID_DATA;
+  }
+  return result;
+}
+
+ma_result archiveCompress(const char * wavPath, const char * flacPath, ma_uint32 dutyPercent, _Atomic bool * stop, const ma_allocation_callbacks * allocationCallbacks, struct archive_result * result) {
+  char partPath[ARCHIVE_PATH_MAX + 8];
+  ma_decoder_config config = ma_decoder_config_init_default();
+  ma_decoder decoder;
+  struct flac_encoder encoder;
+  ma_uint64 cpuStart = cpuUs();
+  ma_uint64 sliceStart = cpuStart;
+  ma_uint64 hash = 1469598103934665603ull;
+  ma_result status;
+
+  memset(result, 0, sizeof(*result));
+  if (allocationCallbacks != NULL) {
+    config.allocationCallbacks = *allocationCallbacks;
+  }
+  if (ma_decoder_init_file(wavPath, &config, &decoder) != MA_SUCCESS) {
+    return MA_INVALID_FILE;
+  }
+  ma_format format = decoder.outputFormat;
+  ma_uint32 channels = decoder.outputChannels;
+  ma_uint32 bitsPerSample = format == ma_format_s16 ? 16 : 24;
+  if ((format != ma_format_s16 && format != ma_format_f32) || channels > FLAC_CHANNELS_MAX) {
+    ma_decoder_uninit(&decoder);
+    return MA_FORMAT_NOT_SUPPORTED;
+  }
+  result->sampleRate = decoder.outputSampleRate;
+
+  // the raw frames take no more room than the integers they become
+  size_t blockBytes = (size_t)FLAC_BLOCK_FRAMES * channels * sizeof(ma_int32);
+  void * frames = ma_malloc(blockBytes, allocationCallbacks);
+  ma_int32 * samples = ma_malloc(blockBytes, allocationCallbacks);
+  snprintf(partPath, sizeof(partPath), "%s.part", flacPath);
+  int fd = open(partPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (frames == NULL || samples == NULL || fd < 0) {
+    status = fd < 0 ? MA_IO_ERROR : MA_OUT_OF_MEMORY;
+    goto done;
+  }
+  status = flacEncoderInit(&encoder, fd, channels, result->sampleRate, bitsPerSample, allocationCallbacks);
+  if (status != MA_SUCCESS) {
+    goto done;
+  }
+
+  for (;;) {
+    ma_uint64 read = readBlock(&decoder, frames, ma_get_bytes_per_frame(format, channels));
+    if (read == 0) {
+      break;
+    }
+    if (!toIntegers(format, frames, samples, read * channels)) {
+      status = MA_FORMAT_NOT_SUPPORTED;
+      break;
+    }
+    hash = hashSamples(hash, samples, read * channels);
+    status = flacEncodeBlock(&encoder, samples, (ma_uint32)read);
+    if (status != MA_SUCCESS) {
+      break;
+    }
+    throttle(&sliceStart, dutyPercent);
+    if (stop != NULL && atomic_load(stop)) {
+      status = MA_CANCELLED;
+      break;
+    }
+  }
+  if (status == MA_SUCCESS) {
+    status = flacEncoderFinish(&encoder);
+  }
+  if (status == MA_SUCCESS && fdatasync(fd) != 0) {
+    status = MA_IO_ERROR;
+  }
+  result->frames = encoder.totalFrames;
+  flacEncoderUninit(&encoder);
+
+  if (status == MA_SUCCESS) {
+    status = verify(partPath, bitsPerSample, result->frames, hash, samples, dutyPercent, stop, config, &sliceStart);
+  }
+  if (status == MA_SUCCESS && rename(partPath, flacPath) != 0) {
+    status = MA_IO_ERROR;
+  }
+
+done:
+  if (fd >= 0) {
+    close(fd);
+    if (status != MA_SUCCESS) {
+      unlink(partPath);
+    }
+  }
+  ma_free(samples, allocationCallbacks);
+  ma_free(frames, allocationCallbacks);
+  ma_decoder_uninit(&decoder);
+  if (status == MA_SUCCESS) {
+    result->wavBytes = fileBytes(wavPath);
+    result->flacBytes = fileBytes(flacPath);
+  }
+  result->cpuSeconds = (cpuUs() - cpuStart) / 1e6;
+  return status;
+}
+
+static void compressTake(struct archive * archive, const char * wavPath) {
+  char flacPath[ARCHIVE_PATH_MAX];
+  struct archive_result result;
+  size_t length = strlen(wavPath);
+
+  snprintf(flacPath, sizeof(flacPath), "%.*s.flac", (int)(length > 4 ? length - 4 : length), wavPath);
+  // a zeroed copy means there were none, and miniaudio wants NULL for that
+  ma_result status = archiveCompress(wavPath, flacPath, ARCHIVE_DUTY_PERCENT, &archive->stopping,
+                                     archive->allocationCallbacks.onFree != NULL ? &archive->allocationCallbacks : NULL, &result);
+  if (status == MA_SUCCESS) {
+    unlink(wavPath);
+    printf("Archived %s: %.1f MB down to %.1f MB (%.0f%%), %.2f s of CPU\n", flacPath,
+           result.wavBytes / 1e6, result.flacBytes / 1e6, result.wavBytes > 0 ? 100.0 * result.flacBytes / result.wavBytes : 0.0, result.cpuSeconds);
+  } else if (status == MA_FORMAT_NOT_SUPPORTED) {
+    printf("Keeping %s as WAV: its samples don't fit in 24 bits.\n", wavPath);
+  } else if (status == MA_CANCELLED) {
+    printf("Stopped compressing %s, it stays WAV until the session is next run with --compress.\n", wavPath);
+  } else {
+    printf("Failed to compress %s, keeping the WAV.\n", wavPath);
+  }
+}
+
+static void * archiveThread(void * arg) {
+  struct archive * archive = (struct archive *)arg;
+  char path[ARCHIVE_PATH_MAX];
+
+#ifdef SCHED_IDLE
+  // only runs when nothing else wants the CPU
+  struct sched_param param = { 0 };
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+
+  pthread_mutex_lock(&archive->lock);
+  while (archive->running) {
+    if (archive->count == 0) {
+      pthread_cond_wait(&archive->wake, &archive->lock);
+      continue;
+    }
+    memcpy(path, archive->queue[archive->head], sizeof(path));
+    archive->head = (archive->head + 1) % ARCHIVE_QUEUE;
+    archive->count--;
+    pthread_mutex_unlock(&archive->lock);
+    compressTake(archive, path);
+    pthread_mutex_lock(&archive->lock);
+  }
+  pthread_mutex_unlock(&archive->lock);
+  return NULL;
+}
+
+ma_result archiveInit(struct archive * archive, const ma_allocation_callbacks * allocationCallbacks) {
+  memset(archive, 0, sizeof(*archive));
+  if (allocationCallbacks != NULL) {
+    archive->allocationCallbacks = *allocationCallbacks;
+  }
+  pthread_mutex_init(&archive->lock, NULL);
+  pthread_cond_init(&archive->wake, NULL);
+  archive->running = true;
+  if (pthread_create(&archive->thread, NULL, archiveThread, archive) != 0) {
+    pthread_cond_destroy(&archive->wake);
+    pthread_mutex_destroy(&archive->lock);
+    return MA_ERROR;
+  }
+  return MA_SUCCESS;
+}
+
+void archiveUninit(struct archive * archive) {
+  atomic_store(&archive->stopping, true);
+  pthread_mutex_lock(&archive->lock);
+  archive->running = false;
+  pthread_cond_broadcast(&archive->wake);
+  pthread_mutex_unlock(&archive->lock);
+  pthread_join(archive->thread, NULL);
+
+  pthread_cond_destroy(&archive->wake);
+  pthread_mutex_destroy(&archive->lock);
+  if (archive->count > 0) {
+    printf("%d more takes stay WAV until the session is next run with --compress.\n", archive->count);
+  }
+}
+
+void archiveAdd(struct archive * archive, const char * wavPath) {
+  pthread_mutex_lock(&archive->lock);
+  if (archive->count == ARCHIVE_QUEUE) {
+    printf("Too many takes waiting to be compressed, leaving %s as WAV.\n", wavPath);
+  } else {
+    snprintf(archive->queue[(archive->head + archive->count) % ARCHIVE_QUEUE], ARCHIVE_PATH_MAX, "%s", wavPath);
+    archive->count++;
+    pthread_cond_broadcast(&archive->wake);
+  }
+  pthread_mutex_unlock(&archive->lock);
+}
+
+void archiveSweep(struct archive * archive, const char * dir) {
+  char path[ARCHIVE_PATH_MAX];
+  DIR * listing = opendir(dir);
+  struct dirent * entry;
+
+  if (listing == NULL) {
+    return;
+  }
+  // anything of ours still a WAV either never got its turn or wasn't finished
+  while ((entry = readdir(listing)) != NULL) {
+    size_t length = strlen(entry->d_name);
+    if (strncmp(entry->d_name, "take-", 5) == 0 && length > 4 && strcmp(entry->d_name + length - 4, ".wav") == 0) {
+      snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+      archiveAdd(archive, path);
+    }
+  }
+  closedir(listing);
+}
@@ -0,0 +1,66 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include "miniaudio.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Share of one core the archive thread may use while it's compressing
+#define ARCHIVE_DUTY_PERCENT 50
+// How much CPU time it spends between sleeps
+#define ARCHIVE_SLICE_MS 20
+// Finished takes waiting to be compressed; any more are left as WAV until
+// the session is next swept
+#define ARCHIVE_QUEUE 32
+#define ARCHIVE_PATH_MAX 576
+
+// What compressing one take came to
+struct archive_result
+{
+  ma_uint64 frames;
+  ma_uint32 sampleRate;
+  ma_uint64 wavBytes;
+  ma_uint64 flacBytes;
+  double cpuSeconds;            // this thread's CPU time, sleeps not included
+};
+
+// Compresses finished takes to FLAC on a background thread running at idle
+// priority (SCHED_IDLE where there is one), throttled to
+// ARCHIVE_DUTY_PERCENT of a core on top of that so a Pi with no spare core
+// still has room for the control thread. Each FLAC is decoded again and
+// checked sample for sample against the take before the WAV is removed.
+//
+// f32 takes are only compressed if every sample is a 24-bit integer in
+// disguise, as it is when the interface captures at 24 bits or less;
+// anything else stays WAV.
+struct archive
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  bool running;
+  _Atomic bool stopping;        // abandons the take in progress
+  char queue[ARCHIVE_QUEUE][ARCHIVE_PATH_MAX];
+  int head;
+  int count;
+  ma_allocation_callbacks allocationCallbacks;
+};
+
+// `allocationCallbacks` (may be NULL) is used for the decoders and the encoder
+ma_result archiveInit(struct archive * archive, const ma_allocation_callbacks * allocationCallbacks);
+// Stops after the take in progress is abandoned; queued takes stay WAV
+void archiveUninit(struct archive * archive);
+// Queue a finished take. Does not block on the compression.
+void archiveAdd(struct archive * archive, const char * wavPath);
+// Queue every take in `dir` still waiting to be compressed
+void archiveSweep(struct archive * archive, const char * dir);
+
+// Compress `wavPath` to `flacPath` on the calling thread, using up to
+// `dutyPercent` of a core. Leaves the WAV alone; returns MA_CANCELLED if
+// `stop` (may be NULL) is set part way, MA_FORMAT_NOT_SUPPORTED for a take
+// FLAC can't hold exactly, and MA_INVALID_DATA if the FLAC doesn't decode
+// back to the take.
+ma_result archiveCompress(const char * wavPath, const char * flacPath, ma_uint32 dutyPercent, _Atomic bool * stop, const ma_allocation_callbacks * allocationCallbacks, struct archive_result * result);
+
+#endif
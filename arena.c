@@ -0,0 +1,168 @@
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ARENA_DEBUG
+static _Thread_local bool audioThread = false;
+
+void arenaAudioThread(void) {
+  audioThread = true;
+}
+
+static void checkThread(void) {
+  if (audioThread) {
+    printf("Allocation from an audio thread\n");
+    fflush(stdout);
+    abort();
+  }
+}
+#else
+#define checkThread()
+#endif
+
+// Every block, free or not, starts with one of these. The header is a full
+// alignment unit so what follows it is aligned for anything.
+#define ARENA_ALIGN 16
+
+struct block
+{
+  size_t size;            // including this header
+  struct block * next;    // only meaningful while the block is free
+};
+
+#define HEADER (((sizeof(struct block) + ARENA_ALIGN - 1) / ARENA_ALIGN) * ARENA_ALIGN)
+
+bool arenaInit(struct arena * arena, size_t size) {
+  memset(arena, 0, sizeof(*arena));
+  size = size / ARENA_ALIGN * ARENA_ALIGN;
+  if (posix_memalign((void **)&arena->base, ARENA_ALIGN, size) != 0) {
+    return false;
+  }
+  // fault every page in now rather than on first use
+  memset(arena->base, 0, size);
+  arena->size = size;
+
+  struct block * all = (struct block *)arena->base;
+  all->size = size;
+  all->next = NULL;
+  arena->free = all;
+  pthread_mutex_init(&arena->lock, NULL);
+  return true;
+}
+
+void arenaUninit(struct arena * arena) {
+  pthread_mutex_destroy(&arena->lock);
+  free(arena->base);
+  arena->base = NULL;
+}
+
+void * arenaAlloc(struct arena * arena, size_t size) {
+  size_t need = HEADER + (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+  void * pointer = NULL;
+
+  checkThread();
+  pthread_mutex_lock(&arena->lock);
+  for (struct block ** link = (struct block **)&arena->free; *link != NULL; link = &(*link)->next) {
+    struct block * found = *link;
+    if (found->size < need) {
+      continue;
+    }
+    // split off the rest unless it's too small to be worth keeping
+    if (found->size - need >= HEADER + ARENA_ALIGN) {
+      struct block * rest = (struct block *)((unsigned char *)found + need);
+      rest->size = found->size - need;
+      rest->next = found->next;
+      found->size = need;
+      *link = rest;
+    } else {
+      *link = found->next;
+    }
+    arena->used += found->size;
+    if (arena->used > arena->peak) {
+      arena->peak = arena->used;
+    }
+    pointer = (unsigned char *)found + HEADER;
+    break;
+  }
+  pthread_mutex_unlock(&arena->lock);
+
+  if (pointer == NULL) {
+    printf("Arena out of memory (%zu bytes asked for, %zu of %zu in use)\n", size, arena->used, arena->size);
+  }
+  return pointer;
+}
+
+void arenaFree(struct arena * arena, void * pointer) {
+  if (pointer == NULL) {
+    return;
+  }
+  checkThread();
+
+  struct block * freed = (struct block *)((unsigned char *)pointer - HEADER);
+  struct block ** link = (struct block **)&arena->free;
+
+  pthread_mutex_lock(&arena->lock);
+  arena->used -= freed->size;
+  // keep the list in address order so neighbours can merge back together
+  while (*link != NULL && *link < freed) {
+    link = &(*link)->next;
+  }
+  freed->next = *link;
+  *link = freed;
+  if (freed->next != NULL && (unsigned char *)freed + freed->size == (unsigned char *)freed->next) {
+    freed->size += freed->next->size;
+    freed->next = freed->next->next;
+  }
+  if (link != (struct block **)&arena->free) {
+    // `link` points into the previous free block's `next` field
+    struct block * before = (struct block *)((unsigned char *)link - offsetof(struct block, next));
+    if ((unsigned char *)before + before->size == (unsigned char *)freed) {
+      before->size += freed->size;
+      before->next = freed->next;
+    }
+  }
+  pthread_mutex_unlock(&arena->lock);
+}
+
+void * arenaRealloc(struct arena * arena, void * pointer, size_t size) {
+  if (pointer == NULL) {
+    return arenaAlloc(arena, size);
+  }
+  if (size == 0) {
+    arenaFree(arena, pointer);
+    return NULL;
+  }
+
+  size_t had = ((struct block *)((unsigned char *)pointer - HEADER))->size - HEADER;
+  if (size <= had) {
+    return pointer;
+  }
+  void * moved = arenaAlloc(arena, size);
+  if (moved != NULL) {
+    memcpy(moved, pointer, had);
+    arenaFree(arena, pointer);
+  }
+  return moved;
+}
+
+static void * onMalloc(size_t size, void * userData) {
+  return arenaAlloc((struct arena *)userData, size);
+}
+
+static void * onRealloc(void * pointer, size_t size, void * userData) {
+  return arenaRealloc((struct arena *)userData, pointer, size);
+}
+
+static void onFree(void * pointer, void * userData) {
+  arenaFree((struct arena *)userData, pointer);
+}
+
+ma_allocation_callbacks arenaCallbacks(struct arena * arena) {
+  ma_allocation_callbacks callbacks;
+  callbacks.pUserData = arena;
+  callbacks.onMalloc  = onMalloc;
+  callbacks.onRealloc = onRealloc;
+  callbacks.onFree    = onFree;
+  return callbacks;
+}
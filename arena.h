@@ -0,0 +1,48 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "miniaudio.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Enough for the context, the devices and their converters, and the
+// archive's decoders and encoder, with room to spare. The writer gets an
+// arena of its own, sized by wavWriterBytes once the format is settled.
+#define ARENA_SIZE (8 * 1024 * 1024)
+
+// One block taken from the heap at startup, then handed out and taken back
+// through miniaudio's allocation callbacks, so nothing miniaudio needs after
+// startup ever touches malloc. A plain
+// first-fit free list under a mutex: nothing on an audio thread may allocate,
+// so the lock is only ever contended by the control and writer threads.
+//
+// Build with -DARENA_DEBUG to abort on any allocation from a thread that has
+// run an audio callback.
+struct arena
+{
+  pthread_mutex_t lock;
+  unsigned char * base;
+  size_t size;
+  void * free;          // address-ordered list of free blocks
+  size_t used;
+  size_t peak;
+};
+
+bool arenaInit(struct arena * arena, size_t size);
+void arenaUninit(struct arena * arena);
+void * arenaAlloc(struct arena * arena, size_t size);
+void * arenaRealloc(struct arena * arena, void * pointer, size_t size);
+void arenaFree(struct arena * arena, void * pointer);
+// Hand these to ma_context_config, wavWriterInit and friends
+ma_allocation_callbacks arenaCallbacks(struct arena * arena);
+
+#ifdef ARENA_DEBUG
+// Mark the calling thread as an audio thread
+void arenaAudioThread(void);
+#define ARENA_AUDIO_THREAD() arenaAudioThread()
+#else
+#define ARENA_AUDIO_THREAD()
+#endif
+
+#endif
@@ -0,0 +1,86 @@
+#include "buttons.h"
+#include "bcm2835.h"
+
+bool buttonsInit(struct buttons * buttons, const uint8_t * pins, int count, uint64_t pressUs, uint64_t releaseUs) {
+  if (count > BUTTONS_MAX) {
+    return false;
+  }
+
+  buttons->count   = count;
+  buttons->mask    = 0;
+  buttons->pending = 0;
+  for (int i = 0; i < count; i++) {
+    if (pins[i] >= 32) {
+      return false;
+    }
+    debounceInit(&buttons->pins[i], pins[i], pressUs, releaseUs);
+    buttons->mask |= 1u << pins[i];
+
+    // Arrange buttons between their pin and ground (PULL UP)
+    bcm2835_gpio_fsel(pins[i], BCM2835_GPIO_FSEL_INPT);
+    bcm2835_gpio_set_pud(pins[i], BCM2835_GPIO_PUD_UP);
+    bcm2835_gpio_fen(pins[i]);
+    bcm2835_gpio_ren(pins[i]);
+  }
+
+  // throw away anything latched before we were watching
+  bcm2835_gpio_set_eds_multi(buttons->mask);
+  buttons->lastPollUs = debounceNow();
+  return true;
+}
+
+void buttonsUninit(struct buttons * buttons) {
+  for (int i = 0; i < buttons->count; i++) {
+    bcm2835_gpio_clr_fen(buttons->pins[i].pin);
+    bcm2835_gpio_clr_ren(buttons->pins[i].pin);
+  }
+  bcm2835_gpio_set_eds_multi(buttons->mask);
+}
+
+uint32_t buttonsPoll(struct buttons * buttons) {
+  uint32_t pressed = 0;
+  uint64_t now = debounceNow();
+  uint64_t sinceLastPoll = now - buttons->lastPollUs;
+  uint32_t edges = bcm2835_gpio_eds_multi(buttons->mask);
+
+  buttons->lastPollUs = now;
+  if (edges == 0 && buttons->pending == 0) {
+    return 0;
+  }
+  // writing 1s clears the latched events we're about to handle
+  if (edges != 0) {
+    bcm2835_gpio_set_eds_multi(edges);
+  }
+
+  uint32_t levels = bcm2835_peri_read(bcm2835_gpio + BCM2835_GPLEV0/4);
+  for (int i = 0; i < buttons->count; i++) {
+    struct debounce * button = &buttons->pins[i];
+    uint32_t bit = 1u << button->pin;
+    uint8_t level = (levels & bit) ? HIGH : LOW;
+
+    if ((edges & bit) && !button->pressed && level == HIGH && sinceLastPoll >= button->pressUs) {
+      // Pressed and let go again between two polls. The latch is the only
+      // evidence, but the pin was left alone for longer than a press takes
+      // to settle, so it counts - the release is debounced from here on.
+      button->pressed = true;
+      button->level   = HIGH;
+      button->since   = now;
+      pressed |= 1u << i;
+    } else {
+      if ((edges & bit) && level == button->level) {
+        // it bounced away and back since the last poll - restart the clock
+        button->since = now;
+      }
+      if (debounceSample(button, level, now)) {
+        pressed |= 1u << i;
+      }
+    }
+
+    if (button->level != (button->pressed ? LOW : HIGH)) {
+      buttons->pending |= bit;
+    } else {
+      buttons->pending &= ~bit;
+    }
+  }
+  return pressed;
+}
@@ -0,0 +1,33 @@
+#ifndef BUTTONS_H
+#define BUTTONS_H
+
+#include "debounce.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BUTTONS_MAX 8
+
+// All of the looper's buttons, harvested together. Rising and falling edge
+// detection is armed on every pin so the GPEDS0 latch remembers presses that
+// happen while the main loop is busy, and a single GPEDS0 read per tick tells
+// us whether any pin moved at all. GPLEV0 is only read (once, for every pin)
+// while some button is still settling.
+//
+// Only GPIO 0-31 (bank 0) are supported, which covers the whole 40 pin header.
+struct buttons
+{
+  int count;
+  uint32_t mask;                       // GPIO bits of every configured pin
+  uint32_t pending;                    // GPIO bits whose debounce hasn't settled yet
+  uint64_t lastPollUs;
+  struct debounce pins[BUTTONS_MAX];
+};
+
+bool buttonsInit(struct buttons * buttons, const uint8_t * pins, int count, uint64_t pressUs, uint64_t releaseUs);
+// Disarms edge detection - leaving it enabled after exit can upset the kernel
+void buttonsUninit(struct buttons * buttons);
+
+// Returns a mask with bit i set for every pins[i] pressed since the last poll
+uint32_t buttonsPoll(struct buttons * buttons);
+
+#endif
@@ -0,0 +1,193 @@
+#include "calibrate.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Let both devices settle before sending the chirp
+#define CALIBRATE_LEAD_IN_MS 250
+// Longest round trip we look for
+#define CALIBRATE_MAX_MS 500
+// Normalized correlation below this is noise, not our chirp
+#define CALIBRATE_MIN_MATCH 0.25
+
+ma_result calibrationInit(struct calibration * calibration, struct event_loop * events, ma_format format, ma_uint32 channels, ma_uint32 sampleRate) {
+  memset(calibration, 0, sizeof(*calibration));
+  calibration->format        = format;
+  calibration->channels      = channels;
+  calibration->sampleRate    = sampleRate;
+  calibration->captureFrames = (ma_uint64)sampleRate * CALIBRATE_SECONDS;
+  calibration->events        = events;
+  atomic_store(&calibration->chirpAt, -1);
+
+  calibration->chirp = malloc(CALIBRATE_CHIRP_FRAMES * sizeof(float));
+  calibration->captured = calloc((size_t)calibration->captureFrames, sizeof(float));
+  if (calibration->chirp == NULL || calibration->captured == NULL) {
+    calibrationUninit(calibration);
+    return MA_OUT_OF_MEMORY;
+  }
+
+  // a windowed linear sweep from 200Hz to 8kHz has one sharp correlation peak
+  double f0 = 200.0, f1 = 8000.0;
+  double duration = (double)CALIBRATE_CHIRP_FRAMES / sampleRate;
+  for (int i = 0; i < CALIBRATE_CHIRP_FRAMES; i++) {
+    double t = (double)i / sampleRate;
+    double phase = 2.0 * M_PI * (f0 * t + (f1 - f0) * t * t / (2.0 * duration));
+    double window = 0.5 - 0.5 * cos(2.0 * M_PI * i / (CALIBRATE_CHIRP_FRAMES - 1));
+    calibration->chirp[i] = (float)(0.5 * window * sin(phase));
+  }
+  return MA_SUCCESS;
+}
+
+void calibrationUninit(struct calibration * calibration) {
+  free(calibration->chirp);
+  free(calibration->captured);
+  calibration->chirp = NULL;
+  calibration->captured = NULL;
+}
+
+bool calibrationDone(struct calibration * calibration) {
+  return atomic_load(&calibration->capturedFrames) == calibration->captureFrames;
+}
+
+void calibrationPlayback(struct calibration * calibration, void * output, ma_uint32 frameCount) {
+  ma_int64 chirpAt = atomic_load_explicit(&calibration->chirpAt, memory_order_relaxed);
+
+  if (chirpAt < 0) {
+    ma_uint64 captured = atomic_load_explicit(&calibration->capturedFrames, memory_order_acquire);
+    if (captured < (ma_uint64)calibration->sampleRate * CALIBRATE_LEAD_IN_MS / 1000) {
+      return;
+    }
+    // the first frame of this period goes out now, against wherever capture has got to
+    atomic_store_explicit(&calibration->chirpAt, (ma_int64)captured, memory_order_relaxed);
+  }
+
+  // same chirp on every output channel; the buffer is already silent around it
+  for (ma_uint32 i = 0; i < frameCount && calibration->chirpPlayed < CALIBRATE_CHIRP_FRAMES; i++) {
+    float sample = calibration->chirp[calibration->chirpPlayed];
+    for (ma_uint32 c = 0; c < calibration->channels; c++) {
+      if (calibration->format == ma_format_s16) {
+        ((ma_int16 *)output)[i * calibration->channels + c] = (ma_int16)(sample * 32767.0f);
+      } else {
+        ((float *)output)[i * calibration->channels + c] = sample;
+      }
+    }
+    calibration->chirpPlayed++;
+  }
+}
+
+void calibrationCapture(struct calibration * calibration, const void * input, ma_uint32 frameCount) {
+  ma_uint64 captured = atomic_load_explicit(&calibration->capturedFrames, memory_order_relaxed);
+  ma_uint64 room = calibration->captureFrames - captured;
+
+  if (room == 0) {
+    return;
+  }
+  if (frameCount > room) {
+    frameCount = (ma_uint32)room;
+  }
+  for (ma_uint32 i = 0; i < frameCount; i++) {
+    if (calibration->format == ma_format_s16) {
+      calibration->captured[captured + i] = ((const ma_int16 *)input)[i * calibration->channels] / 32768.0f;
+    } else {
+      calibration->captured[captured + i] = ((const float *)input)[i * calibration->channels];
+    }
+  }
+  atomic_store_explicit(&calibration->capturedFrames, captured + frameCount, memory_order_release);
+  if (captured + frameCount == calibration->captureFrames) {
+    eventLoopNotify(calibration->events);
+  }
+}
+
+ma_int64 calibrationMeasure(struct calibration * calibration) {
+  ma_int64 chirpAt = atomic_load(&calibration->chirpAt);
+  ma_uint64 first, last;
+  double chirpEnergy = 0.0;
+  double best = 0.0;
+  ma_uint64 bestLag = 0;
+
+  if (chirpAt < 0 || !calibrationDone(calibration)) {
+    return -1;
+  }
+  first = (ma_uint64)chirpAt;
+  last = first + (ma_uint64)calibration->sampleRate * CALIBRATE_MAX_MS / 1000;
+  if (last + CALIBRATE_CHIRP_FRAMES > calibration->captureFrames) {
+    last = calibration->captureFrames - CALIBRATE_CHIRP_FRAMES;
+  }
+
+  // plain time-domain cross-correlation - it only runs once, off the audio threads
+  for (ma_uint64 lag = first; lag <= last; lag++) {
+    const float * window = calibration->captured + lag;
+    double sum = 0.0;
+    for (int i = 0; i < CALIBRATE_CHIRP_FRAMES; i++) {
+      sum += (double)calibration->chirp[i] * window[i];
+    }
+    if (fabs(sum) > best) {
+      best = fabs(sum);
+      bestLag = lag;
+    }
+  }
+
+  // how much of what came back at the peak actually looks like the chirp
+  double windowEnergy = 0.0;
+  for (int i = 0; i < CALIBRATE_CHIRP_FRAMES; i++) {
+    chirpEnergy += (double)calibration->chirp[i] * calibration->chirp[i];
+    windowEnergy += (double)calibration->captured[bestLag + i] * calibration->captured[bestLag + i];
+  }
+  if (windowEnergy == 0.0 || best / sqrt(chirpEnergy * windowEnergy) < CALIBRATE_MIN_MATCH) {
+    return -1;
+  }
+  return (ma_int64)(bestLag - first);
+}
+
+void latencyKey(char * key, size_t size, ma_device * capture, ma_device * playback, ma_uint32 sampleRate) {
+  // the round trip grows with the buffers, so it's only good for the size it was measured at
+  snprintf(key, size, "%s|%s|%u|%ux%u", capture->capture.name, playback->playback.name, sampleRate,
+           playback->playback.internalPeriodSizeInFrames, playback->playback.internalPeriods);
+}
+
+// latency.cfg is "<capture>|<playback>|<rate>|<period>x<periods>\t<frames>" per line
+ma_uint64 latencyLoad(const char * key) {
+  FILE * file = fopen(CALIBRATE_FILE, "r");
+  char line[1024];
+  size_t keyLength = strlen(key);
+  ma_uint64 frames = 0;
+
+  if (file == NULL) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (strncmp(line, key, keyLength) == 0 && line[keyLength] == '\t') {
+      frames = strtoull(line + keyLength + 1, NULL, 10);
+    }
+  }
+  fclose(file);
+  return frames;
+}
+
+bool latencySave(const char * key, ma_uint64 frames) {
+  FILE * file = fopen(CALIBRATE_FILE, "r");
+  FILE * out;
+  char line[1024];
+  size_t keyLength = strlen(key);
+
+  // rewrite the file without this pair's old line, then add the new one
+  out = fopen(CALIBRATE_FILE ".tmp", "w");
+  if (out == NULL) {
+    if (file != NULL) fclose(file);
+    return false;
+  }
+  if (file != NULL) {
+    while (fgets(line, sizeof(line), file) != NULL) {
+      if (!(strncmp(line, key, keyLength) == 0 && line[keyLength] == '\t')) {
+        fputs(line, out);
+      }
+    }
+    fclose(file);
+  }
+  fprintf(out, "%s\t%llu\n", key, (unsigned long long)frames);
+  if (fclose(out) != 0) {
+    return false;
+  }
+  return rename(CALIBRATE_FILE ".tmp", CALIBRATE_FILE) == 0;
+}
@@ -0,0 +1,54 @@
+#ifndef CALIBRATE_H
+#define CALIBRATE_H
+
+#include "miniaudio.h"
+#include "events.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Length of the test chirp and how long we listen for it to come back
+#define CALIBRATE_CHIRP_FRAMES 4096
+#define CALIBRATE_SECONDS 2
+// Where measured offsets are kept, one line per device pair
+#define CALIBRATE_FILE "latency.cfg"
+
+// Round-trip latency measurement. The playback side sends a chirp once the
+// capture side has been running a moment, noting how far capture had got when
+// it did; the capture side records until its buffer is full and wakes the
+// control thread. The cross-correlation peak against the chirp, less that
+// starting point, is how many frames late anything we record lands against
+// what was playing when it was played.
+struct calibration
+{
+  ma_format format;                 // f32 or s16, same as the tracks
+  ma_uint32 channels;
+  ma_uint32 sampleRate;
+  float * chirp;                    // mono test signal
+  float * captured;                 // first input channel only
+  ma_uint64 captureFrames;          // size of `captured`
+  _Atomic ma_uint64 capturedFrames;
+  _Atomic ma_int64 chirpAt;         // capture frame the chirp went out on, -1 until then
+  ma_uint64 chirpPlayed;            // playback side only
+  struct event_loop * events;
+};
+
+ma_result calibrationInit(struct calibration * calibration, struct event_loop * events, ma_format format, ma_uint32 channels, ma_uint32 sampleRate);
+void calibrationUninit(struct calibration * calibration);
+// true once the capture side has everything it needs
+bool calibrationDone(struct calibration * calibration);
+// Find the chirp in what came back. Returns the round trip in frames, or -1 if
+// it wasn't heard clearly enough to trust.
+ma_int64 calibrationMeasure(struct calibration * calibration);
+
+// real-time safe, called from the device callbacks in place of the engine
+void calibrationPlayback(struct calibration * calibration, void * output, ma_uint32 frameCount);
+void calibrationCapture(struct calibration * calibration, const void * input, ma_uint32 frameCount);
+
+// Offsets are stored per capture/playback device pair, sample rate and
+// playback buffer size.
+// latencyLoad returns 0 for a pair that was never calibrated.
+void latencyKey(char * key, size_t size, ma_device * capture, ma_device * playback, ma_uint32 sampleRate);
+ma_uint64 latencyLoad(const char * key);
+bool latencySave(const char * key, ma_uint64 frames);
+
+#endif
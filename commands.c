@@ -0,0 +1,48 @@
+#include "commands.h"
+
+void commandQueueInit(struct command_queue * queue) {
+  atomic_store(&queue->head, 0);
+  atomic_store(&queue->tail, 0);
+}
+
+unsigned commandRoom(struct command_queue * queue) {
+  unsigned tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+  return COMMAND_QUEUE_SIZE - (tail - head);
+}
+
+bool commandPush(struct command_queue * queue, struct command command) {
+  unsigned tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+  if (tail - head == COMMAND_QUEUE_SIZE) {
+    return false;
+  }
+  queue->items[tail & (COMMAND_QUEUE_SIZE - 1)] = command;
+  atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+bool commandPop(struct command_queue * queue, struct command * command) {
+  unsigned head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+  if (head == tail) {
+    return false;
+  }
+  *command = queue->items[head & (COMMAND_QUEUE_SIZE - 1)];
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+  return true;
+}
+
+bool commandPeek(struct command_queue * queue, struct command * command) {
+  unsigned head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+  if (head == tail) {
+    return false;
+  }
+  *command = queue->items[head & (COMMAND_QUEUE_SIZE - 1)];
+  return true;
+}
@@ -0,0 +1,52 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Must be a power of two
+#define COMMAND_QUEUE_SIZE 64
+
+enum command_type
+{
+  CMD_RECORD,       // start a new take on the track
+  CMD_PLAY,         // finish a take or an overdub layer and loop the track
+  CMD_STOP,
+  CMD_OVERDUB,
+  CMD_MUTE,
+  CMD_UNMUTE,
+  CMD_UNDO,         // throw away the track's take
+  CMD_UNDO_LAYER,   // take the last overdub layer back out of the loop
+  CMD_REDO_LAYER    // put the last undone layer back in
+};
+
+struct command
+{
+  enum command_type type;
+  int track;
+  unsigned sequence;    // numbered by engineSend, so one side can keep in step with the other
+};
+
+// Wait-free single-producer/single-consumer queue. The control thread pushes,
+// one audio callback drains it at the start of each period (or, with
+// quantizing, at the boundary the command at its head is waiting for), and
+// neither ever waits on the other.
+struct command_queue
+{
+  struct command items[COMMAND_QUEUE_SIZE];
+  _Atomic unsigned head;    // next slot to read, only moved by the consumer
+  _Atomic unsigned tail;    // next slot to write, only moved by the producer
+};
+
+void commandQueueInit(struct command_queue * queue);
+// Free slots, as the producer sees them. Only the producer uses them up, so
+// there are at least this many until it next pushes.
+unsigned commandRoom(struct command_queue * queue);
+// false if the queue is full - the command is not sent
+bool commandPush(struct command_queue * queue, struct command command);
+// false if there's nothing waiting
+bool commandPop(struct command_queue * queue, struct command * command);
+// Look at the next command without taking it, for one that has to wait its turn
+bool commandPeek(struct command_queue * queue, struct command * command);
+
+#endif
@@ -0,0 +1,43 @@
+#include "debounce.h"
+#include "bcm2835.h"
+#include <time.h>
+
+void debounceInit(struct debounce * button, uint8_t pin, uint64_t pressUs, uint64_t releaseUs) {
+  button->pin       = pin;
+  button->pressUs   = pressUs;
+  button->releaseUs = releaseUs;
+  button->level     = HIGH;
+  button->since     = 0;
+  button->pressed   = false;
+}
+
+bool debounceSample(struct debounce * button, uint8_t level, uint64_t nowUs) {
+  if (level != button->level) {
+    button->level = level;
+    button->since = nowUs;
+    // a zero threshold means trust the first sample
+    if ((level == LOW ? button->pressUs : button->releaseUs) > 0) {
+      return false;
+    }
+  }
+
+  uint64_t held = nowUs - button->since;
+  if (!button->pressed && level == LOW && held >= button->pressUs) {
+    button->pressed = true;
+    return true;
+  }
+  if (button->pressed && level == HIGH && held >= button->releaseUs) {
+    button->pressed = false;
+  }
+  return false;
+}
+
+uint64_t debounceNow(void) {
+  uint64_t now = bcm2835_st_read();
+  if (now == 0) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+  }
+  return now;
+}
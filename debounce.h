@@ -0,0 +1,34 @@
+#ifndef DEBOUNCE_H
+#define DEBOUNCE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// How long the pin has to hold a new level before we believe it. Presses are
+// what the player feels, so keep that one as short as the switches allow.
+#define DEBOUNCE_PRESS_US   5000
+#define DEBOUNCE_RELEASE_US 20000
+
+// Time-based debounce for a button wired to ground with the pull-up enabled.
+// Every sample is timestamped with the BCM2835 system timer, so the debounce
+// window is the same no matter how often (or how regularly) we get to sample.
+struct debounce
+{
+  uint8_t pin;
+  uint64_t pressUs;
+  uint64_t releaseUs;
+  uint8_t level;        // last raw level we saw
+  uint64_t since;       // when `level` was first seen
+  bool pressed;         // debounced state
+};
+
+void debounceInit(struct debounce * button, uint8_t pin, uint64_t pressUs, uint64_t releaseUs);
+
+// Feed one raw sample taken at `nowUs`. Returns true exactly once per press.
+bool debounceSample(struct debounce * button, uint8_t level, uint64_t nowUs);
+
+// Microseconds from the BCM2835 free-running timer, or CLOCK_MONOTONIC when
+// the timer registers aren't mapped (running without root)
+uint64_t debounceNow(void);
+
+#endif
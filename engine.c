@@ -0,0 +1,795 @@
+#include "engine.h"
+#include "layers.h"
+#include "arena.h"
+#include "realtime.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <sys/mman.h>
+
+size_t trackBytes(struct tracks * tracks) {
+  return (size_t)(tracks->capacity * tracks->bytesPerFrame);
+}
+
+ma_result tracksInit(struct tracks * tracks, int count, ma_format format, ma_uint32 channels, ma_uint32 sampleRate, ma_uint32 seconds) {
+  memset(tracks, 0, sizeof(*tracks));
+  tracks->format        = format;
+  tracks->channels      = channels;
+  tracks->sampleRate    = sampleRate;
+  tracks->bytesPerFrame = ma_get_bytes_per_frame(format, channels);
+  tracks->capacity      = (ma_uint64)sampleRate * seconds;
+  tracks->count         = count;
+  tracks->fadeFrames    = sampleRate * LOOP_CROSSFADE_MS / 1000;
+
+  // the mixer has kernels for these two only
+  if (count < 1 || count > TRACKS_MAX || (format != ma_format_f32 && format != ma_format_s16)) {
+    return MA_INVALID_ARGS;
+  }
+  for (int t = 0; t < count; t++) {
+    // mapped rather than malloced, so a saved loop can be mapped over the start of it
+    void * frames = mmap(NULL, trackBytes(tracks), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (frames == MAP_FAILED) {
+      tracksUninit(tracks);
+      return MA_OUT_OF_MEMORY;
+    }
+    tracks->frames[t] = frames;
+    // touch every page now so the capture callback never takes a page fault
+    memset(tracks->frames[t], 0, trackBytes(tracks));
+    tracks->seams[t] = calloc((size_t)sampleRate * LOOP_CROSSFADE_MAX_MS / 1000, tracks->bytesPerFrame);
+    if (tracks->seams[t] == NULL) {
+      tracksUninit(tracks);
+      return MA_OUT_OF_MEMORY;
+    }
+    tracks->gain[t] = 1.0f;
+  }
+  return MA_SUCCESS;
+}
+
+void tracksUninit(struct tracks * tracks) {
+  for (int t = 0; t < TRACKS_MAX; t++) {
+    if (tracks->frames[t] != NULL) {
+      munmap(tracks->frames[t], trackBytes(tracks));
+    }
+    free(tracks->seams[t]);
+    tracks->frames[t] = NULL;
+    tracks->seams[t] = NULL;
+  }
+}
+
+bool trackFull(struct tracks * tracks, int track) {
+  return atomic_load(&tracks->length[track]) == tracks->capacity;
+}
+
+void trackReset(struct tracks * tracks, int track) {
+  // playback goes back to reading the take itself before the take goes away
+  atomic_store_explicit(&tracks->closed[track], false, memory_order_relaxed);
+  atomic_store_explicit(&tracks->seamLength[track], 0, memory_order_release);
+  atomic_store_explicit(&tracks->length[track], 0, memory_order_release);
+}
+
+static ma_int16 clip16(ma_int32 x);
+
+// How much closing a take of `length` frames will take off it
+static ma_uint32 closeFade(struct tracks * tracks, ma_uint64 length) {
+  // the fade can't run into itself on a very short take
+  return tracks->fadeFrames > length / 2 ? (ma_uint32)(length / 2) : tracks->fadeFrames;
+}
+
+void trackClose(struct tracks * tracks, int track) {
+  ma_uint64 length = atomic_load_explicit(&tracks->length[track], memory_order_relaxed);
+  ma_uint32 fade = closeFade(tracks, length);
+
+  if (fade > 0) {
+    ma_uint64 tail = (length - fade) * tracks->channels;
+
+    // the head fades in as the frames that followed the new end fade out, so
+    // the last frame of the shortened take runs straight into the first
+    for (ma_uint32 i = 0; i < fade; i++) {
+      float angle = (i + 0.5f) / fade * (float)M_PI_2;
+      float in = sinf(angle), out = cosf(angle);
+      for (ma_uint32 c = 0; c < tracks->channels; c++) {
+        ma_uint32 s = i * tracks->channels + c;
+        if (tracks->format == ma_format_s16) {
+          const ma_int16 * take = (const ma_int16 *)tracks->frames[track];
+          // equal power peaks at about 1.41x on correlated material, so this saturates like the mix
+          ((ma_int16 *)tracks->seams[track])[s] = clip16((ma_int32)lrintf(take[s] * in + take[tail + s] * out));
+        } else {
+          const float * take = (const float *)tracks->frames[track];
+          ((float *)tracks->seams[track])[s] = take[s] * in + take[tail + s] * out;
+        }
+      }
+    }
+    atomic_store_explicit(&tracks->length[track], length - fade, memory_order_release);
+  }
+  // playback loads the seam before the length, so once it sees one it sees both
+  atomic_store_explicit(&tracks->seamLength[track], fade, memory_order_release);
+  atomic_store_explicit(&tracks->closed[track], true, memory_order_release);
+}
+
+void * trackRun(struct tracks * tracks, int track, ma_uint64 cursor, ma_uint64 length, ma_uint32 seam, ma_uint64 * run) {
+  if (cursor < seam) {
+    *run = seam - cursor;
+    return (char *)tracks->seams[track] + cursor * tracks->bytesPerFrame;
+  }
+  *run = length - cursor;
+  return (char *)tracks->frames[track] + cursor * tracks->bytesPerFrame;
+}
+
+ma_uint32 trackWrite(struct tracks * tracks, int track, const void * input, ma_uint32 frameCount) {
+  ma_uint64 length = atomic_load_explicit(&tracks->length[track], memory_order_relaxed);
+  ma_uint64 room = tracks->capacity - length;
+
+  // a full track just stops growing - the take is truncated at its capacity
+  if (frameCount > room) {
+    frameCount = (ma_uint32)room;
+  }
+  if (frameCount == 0) {
+    return 0;
+  }
+
+  memcpy((char *)tracks->frames[track] + length * tracks->bytesPerFrame, input, (size_t)frameCount * tracks->bytesPerFrame);
+  atomic_store_explicit(&tracks->length[track], length + frameCount, memory_order_release);
+  return frameCount;
+}
+
+#if defined(__GNUC__)
+// Four samples at a time. GCC and clang turn this into NEON or SSE where the
+// target has it and into plain VFP code on ARMv6 (Pi Zero/1), without any
+// per-target intrinsics here. memcpy is how we do unaligned vector loads.
+typedef float vec4 __attribute__((vector_size(16)));
+#define VEC_WIDTH 4
+#endif
+
+// out += in * gain
+static void mixKernel(float * restrict out, const float * restrict in, ma_uint32 samples, float gain) {
+  ma_uint32 i = 0;
+#ifdef VEC_WIDTH
+  vec4 g = { gain, gain, gain, gain };
+  for (; i + VEC_WIDTH <= samples; i += VEC_WIDTH) {
+    vec4 o, x;
+    memcpy(&o, out + i, sizeof(o));
+    memcpy(&x, in + i, sizeof(x));
+    o += x * g;
+    memcpy(out + i, &o, sizeof(o));
+  }
+#endif
+  for (; i < samples; i++) {
+    out[i] += in[i] * gain;
+  }
+}
+
+// out += loop * gain; loop = loop * feedback + in - one pass over the loop per period
+static void overdubKernel(float * restrict loop, float * restrict out, const float * restrict in, ma_uint32 samples, float gain, float feedback) {
+  ma_uint32 i = 0;
+#ifdef VEC_WIDTH
+  vec4 g = { gain, gain, gain, gain };
+  vec4 fb = { feedback, feedback, feedback, feedback };
+  for (; i + VEC_WIDTH <= samples; i += VEC_WIDTH) {
+    vec4 l, o, x;
+    memcpy(&l, loop + i, sizeof(l));
+    memcpy(&o, out + i, sizeof(o));
+    memcpy(&x, in + i, sizeof(x));
+    o += l * g;
+    l = l * fb + x;
+    memcpy(out + i, &o, sizeof(o));
+    memcpy(loop + i, &l, sizeof(l));
+  }
+#endif
+  for (; i < samples; i++) {
+    out[i] += loop[i] * gain;
+    loop[i] = loop[i] * feedback + in[i];
+  }
+}
+
+// loop = loop * feedback + in
+static void sumKernel(float * restrict loop, const float * restrict in, ma_uint32 samples, float feedback) {
+  ma_uint32 i = 0;
+#ifdef VEC_WIDTH
+  vec4 fb = { feedback, feedback, feedback, feedback };
+  for (; i + VEC_WIDTH <= samples; i += VEC_WIDTH) {
+    vec4 l, x;
+    memcpy(&l, loop + i, sizeof(l));
+    memcpy(&x, in + i, sizeof(x));
+    l = l * fb + x;
+    memcpy(loop + i, &l, sizeof(l));
+  }
+#endif
+  for (; i < samples; i++) {
+    loop[i] = loop[i] * feedback + in[i];
+  }
+}
+
+// s16 versions of the above. Gains are Q15 and every sum saturates, so a
+// loud mix clips instead of wrapping around.
+#define Q15(x) ((ma_int32)((x) * 32768.0f))
+
+static ma_int16 clip16(ma_int32 x) {
+  return (ma_int16)(x > 32767 ? 32767 : x < -32768 ? -32768 : x);
+}
+
+static void mixKernel16(ma_int16 * restrict out, const ma_int16 * restrict in, ma_uint32 samples, ma_int32 gain) {
+  for (ma_uint32 i = 0; i < samples; i++) {
+    out[i] = clip16(out[i] + ((in[i] * gain) >> 15));
+  }
+}
+
+static void overdubKernel16(ma_int16 * restrict loop, ma_int16 * restrict out, const ma_int16 * restrict in, ma_uint32 samples, ma_int32 gain, ma_int32 feedback) {
+  for (ma_uint32 i = 0; i < samples; i++) {
+    out[i] = clip16(out[i] + ((loop[i] * gain) >> 15));
+    loop[i] = clip16(((loop[i] * feedback) >> 15) + in[i]);
+  }
+}
+
+static void sumKernel16(ma_int16 * restrict loop, const ma_int16 * restrict in, ma_uint32 samples, ma_int32 feedback) {
+  for (ma_uint32 i = 0; i < samples; i++) {
+    loop[i] = clip16(((loop[i] * feedback) >> 15) + in[i]);
+  }
+}
+
+// Pick the kernel for the track format - once per run, never per sample
+static void mixSamples(struct tracks * tracks, void * out, const void * in, ma_uint32 samples, float gain) {
+  if (tracks->format == ma_format_s16) {
+    mixKernel16((ma_int16 *)out, (const ma_int16 *)in, samples, Q15(gain));
+  } else {
+    mixKernel((float *)out, (const float *)in, samples, gain);
+  }
+}
+
+static void overdubSamples(struct tracks * tracks, void * loop, void * out, const void * in, ma_uint32 samples, float gain, float feedback) {
+  if (tracks->format == ma_format_s16) {
+    overdubKernel16((ma_int16 *)loop, (ma_int16 *)out, (const ma_int16 *)in, samples, Q15(gain), Q15(feedback));
+  } else {
+    overdubKernel((float *)loop, (float *)out, (const float *)in, samples, gain, feedback);
+  }
+}
+
+static void sumSamples(struct tracks * tracks, void * loop, const void * in, ma_uint32 samples, float feedback) {
+  if (tracks->format == ma_format_s16) {
+    sumKernel16((ma_int16 *)loop, (const ma_int16 *)in, samples, Q15(feedback));
+  } else {
+    sumKernel((float *)loop, (const float *)in, samples, feedback);
+  }
+}
+
+void trackMix(struct tracks * tracks, int track, void * output, ma_uint32 frameCount) {
+  ma_uint32 seam = atomic_load_explicit(&tracks->seamLength[track], memory_order_acquire);
+  ma_uint64 length = atomic_load_explicit(&tracks->length[track], memory_order_acquire);
+  char * out = (char *)output;
+  float gain = tracks->gain[track];
+
+  if (length == 0) {
+    return;
+  }
+  // the take may have been cut short under us
+  if (tracks->cursor[track] >= length) {
+    tracks->cursor[track] = 0;
+  }
+  if (tracks->muted[track]) {
+    tracks->cursor[track] = (tracks->cursor[track] + frameCount) % length;
+    return;
+  }
+
+  // at most three runs a period: into the wrap, the seam, the rest of the take
+  while (frameCount > 0) {
+    ma_uint64 chunk;
+    const void * loop = trackRun(tracks, track, tracks->cursor[track], length, seam, &chunk);
+    if (chunk > frameCount) {
+      chunk = frameCount;
+    }
+    mixSamples(tracks, out, loop, (ma_uint32)chunk * tracks->channels, gain);
+    out += chunk * tracks->bytesPerFrame;
+    frameCount -= (ma_uint32)chunk;
+    tracks->cursor[track] += chunk;
+    if (tracks->cursor[track] >= length) {
+      tracks->cursor[track] = 0;
+    }
+  }
+}
+
+void trackOverdub(struct tracks * tracks, int track, void * output, const void * input, ma_uint32 frameCount, float feedback, ma_uint64 latency, struct layers * layers) {
+  ma_uint32 seam = atomic_load_explicit(&tracks->seamLength[track], memory_order_acquire);
+  ma_uint64 length = atomic_load_explicit(&tracks->length[track], memory_order_acquire);
+  char * out = (char *)output;
+  const char * in = (const char *)input;
+  // a muted track still takes the new layer, we just don't hear the old ones
+  float gain = tracks->muted[track] ? 0.0f : tracks->gain[track];
+
+  if (length == 0) {
+    return;
+  }
+  if (tracks->cursor[track] >= length) {
+    tracks->cursor[track] = 0;
+  }
+
+  // new layers go wherever that part of the loop is played from, seam included
+  if (latency % length != 0) {
+    // play this period first, then sum the input in behind it - the write
+    // region can overlap what we just read, so they can't share a pass
+    ma_uint64 write = (tracks->cursor[track] + length - latency % length) % length;
+    trackMix(tracks, track, output, frameCount);
+    while (frameCount > 0) {
+      ma_uint64 chunk;
+      void * loop = trackRun(tracks, track, write, length, seam, &chunk);
+      if (chunk > frameCount) {
+        chunk = frameCount;
+      }
+      if (layers != NULL) {
+        layerTouch(layers, tracks, track, write, (ma_uint32)chunk);
+      }
+      sumSamples(tracks, loop, in, (ma_uint32)chunk * tracks->channels, feedback);
+      in += chunk * tracks->bytesPerFrame;
+      frameCount -= (ma_uint32)chunk;
+      write = (write + chunk) % length;
+    }
+    return;
+  }
+
+  // same wrap handling as trackMix, but the input is summed into the track as it goes by
+  while (frameCount > 0) {
+    ma_uint64 chunk;
+    void * loop = trackRun(tracks, track, tracks->cursor[track], length, seam, &chunk);
+    if (chunk > frameCount) {
+      chunk = frameCount;
+    }
+    if (layers != NULL) {
+      layerTouch(layers, tracks, track, tracks->cursor[track], (ma_uint32)chunk);
+    }
+    overdubSamples(tracks, loop, out, in, (ma_uint32)chunk * tracks->channels, gain, feedback);
+    out += chunk * tracks->bytesPerFrame;
+    in += chunk * tracks->bytesPerFrame;
+    frameCount -= (ma_uint32)chunk;
+    tracks->cursor[track] += chunk;
+    if (tracks->cursor[track] >= length) {
+      tracks->cursor[track] = 0;
+    }
+  }
+}
+
+ma_result engineInit(struct engine * engine, struct wav_writer * writer, struct event_loop * events, int trackCount, ma_format format, ma_uint32 channels, ma_uint32 sampleRate, ma_uint32 seconds) {
+  engine->writer   = writer;
+  engine->events   = events;
+  engine->monitor  = false;
+  engine->feedback = 1.0f;
+  engine->latency  = 0;
+  engine->calibration = NULL;
+  engine->layers   = NULL;
+  engine->realtimePriority = 0;
+  engine->quantize = QUANTIZE_OFF;
+  engine->beats    = 4;
+  engine->gridFrames = 0;
+  engine->gridPosition = 0;
+  engine->playbackSequence = 0;
+  engine->capturedFrames = 0;
+  engine->sentSequence = 0;
+  statsInit(&engine->captureStats, "capture", sampleRate);
+  statsInit(&engine->playbackStats, "playback", sampleRate);
+  statsInit(&engine->duplexStats, "duplex", sampleRate);
+  commandQueueInit(&engine->captureQueue);
+  commandQueueInit(&engine->playbackQueue);
+  for (int t = 0; t < TRACKS_MAX; t++) {
+    engine->captureMode[t]  = TRACK_STOPPED;
+    engine->playbackMode[t] = TRACK_STOPPED;
+    engine->controlMode[t]  = TRACK_STOPPED;
+    engine->controlMuted[t] = false;
+    engine->closeIn[t] = 0;
+  }
+  return tracksInit(&engine->tracks, trackCount, format, channels, sampleRate, seconds);
+}
+
+void engineUninit(struct engine * engine) {
+  tracksUninit(&engine->tracks);
+}
+
+// the capture side only cares about takes starting and ending - and, quantized,
+// a take that ended on a boundary may still be running on into its crossfade
+static bool forCapture(struct engine * engine, enum command_type type, int track) {
+  return type == CMD_RECORD || engine->controlMode[track] == TRACK_RECORDING || (type == CMD_UNDO && engine->quantize != QUANTIZE_OFF);
+}
+
+bool engineCanSend(struct engine * engine, enum command_type type, int track) {
+  return commandRoom(&engine->playbackQueue) > 0 && (!forCapture(engine, type, track) || commandRoom(&engine->captureQueue) > 0);
+}
+
+bool engineSend(struct engine * engine, enum command_type type, int track) {
+  struct command command = { type, track, engine->sentSequence + 1 };
+
+  // both sides get the command or neither does, or they'd never agree again
+  if (!engineCanSend(engine, type, track)) {
+    return false;
+  }
+  commandPush(&engine->playbackQueue, command);
+  if (forCapture(engine, type, track)) {
+    commandPush(&engine->captureQueue, command);
+  }
+  engine->sentSequence++;
+
+  switch (type) {
+  case CMD_RECORD:  engine->controlMode[track] = TRACK_RECORDING; break;
+  case CMD_PLAY:    engine->controlMode[track] = TRACK_PLAYING; break;
+  case CMD_OVERDUB: engine->controlMode[track] = TRACK_OVERDUBBING; break;
+  case CMD_STOP:
+  case CMD_UNDO:    engine->controlMode[track] = TRACK_STOPPED; break;
+  case CMD_MUTE:    engine->controlMuted[track] = true; break;
+  case CMD_UNMUTE:  engine->controlMuted[track] = false; break;
+  case CMD_UNDO_LAYER:
+    // undoing the layer that's being played in also ends it
+    if (engine->controlMode[track] == TRACK_OVERDUBBING) {
+      engine->controlMode[track] = TRACK_PLAYING;
+    }
+    break;
+  case CMD_REDO_LAYER: break;
+  }
+  return true;
+}
+
+enum track_mode engineTrackMode(struct engine * engine, int track) {
+  return (enum track_mode)engine->controlMode[track];
+}
+
+bool engineTrackMuted(struct engine * engine, int track) {
+  return engine->controlMuted[track];
+}
+
+bool engineAnyPlaying(struct engine * engine, int except) {
+  for (int t = 0; t < engine->tracks.count; t++) {
+    enum track_mode mode = engineTrackMode(engine, t);
+    if (t != except && (mode == TRACK_PLAYING || mode == TRACK_OVERDUBBING)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int engineUndoable(struct engine * engine, int track) {
+  return engine->layers != NULL ? atomic_load_explicit(&engine->layers->undoable[track], memory_order_relaxed) : 0;
+}
+
+int engineRedoable(struct engine * engine, int track) {
+  return engine->layers != NULL ? atomic_load_explicit(&engine->layers->redoable[track], memory_order_relaxed) : 0;
+}
+
+bool engineWaitClosed(struct engine * engine, int track, int timeoutMs) {
+  struct timespec pause = { 0, 1000000 };
+
+  for (int waited = 0; waited < timeoutMs; waited++) {
+    if (atomic_load_explicit(&engine->tracks.closed[track], memory_order_acquire)) {
+      return true;
+    }
+    nanosleep(&pause, NULL);
+  }
+  return atomic_load_explicit(&engine->tracks.closed[track], memory_order_acquire);
+}
+
+static void closeTake(struct engine * engine, int track) {
+  // the one time the take's length is final - fade the wrap now, not per period
+  trackClose(&engine->tracks, track);
+  engine->captureMode[track] = TRACK_STOPPED;
+}
+
+// true if a take was closed
+static bool applyCaptureCommands(struct engine * engine) {
+  struct command command;
+  bool closed = false;
+
+  while (commandPeek(&engine->captureQueue, &command)) {
+    // quantized, playback decides when each command is due and capture follows it
+    if (engine->quantize != QUANTIZE_OFF && (int)(command.sequence - engine->playbackSequence) > 0) {
+      break;
+    }
+    commandPop(&engine->captureQueue, &command);
+    int t = command.track;
+    if (command.type == CMD_RECORD) {
+      // a new take starts from scratch
+      trackReset(&engine->tracks, t);
+      engine->captureMode[t] = TRACK_RECORDING;
+      engine->closeIn[t] = 0;
+    } else if (command.type == CMD_UNDO) {
+      trackReset(&engine->tracks, t);
+      engine->captureMode[t] = TRACK_STOPPED;
+      engine->closeIn[t] = 0;
+    } else if (engine->captureMode[t] == TRACK_RECORDING && engine->closeIn[t] == 0) {
+      closeTake(engine, t);
+      closed = true;
+    }
+  }
+  return closed;
+}
+
+static void capture(struct engine * engine, const void * input, ma_uint32 frameCount) {
+  struct tracks * tracks = &engine->tracks;
+  ma_uint64 frame = engine->capturedFrames;
+
+  engine->capturedFrames += frameCount;
+  if (engine->calibration != NULL) {
+    calibrationCapture(engine->calibration, input, frameCount);
+    return;
+  }
+  bool closed = applyCaptureCommands(engine);
+  for (int t = 0; t < tracks->count; t++) {
+    if (engine->captureMode[t] == TRACK_RECORDING) {
+      ma_uint32 frames = frameCount;
+      if (engine->closeIn[t] > 0 && engine->closeIn[t] < frames) {
+        frames = engine->closeIn[t];
+      }
+      if (trackWrite(tracks, t, input, frames) > 0 && trackFull(tracks, t)) {
+        // out of room - wake the control thread so it can stop the take
+        eventLoopNotify(engine->events);
+      }
+      // takes are written by the writer thread - never touch the disk from here
+      wavWriterPush(engine->writer, t, frame, input, frames);
+      if (engine->closeIn[t] > 0) {
+        engine->closeIn[t] -= frames;
+        if (engine->closeIn[t] == 0) {
+          closeTake(engine, t);
+          closed = true;
+        }
+      }
+    }
+  }
+
+  if (closed) {
+    // the control thread finishes the take's file once the take itself is done
+    // (and all of it has been pushed)
+    eventLoopNotify(engine->events);
+  }
+}
+
+// The first callback on each audio thread asks for SCHED_FIFO itself: miniaudio
+// only sets the scheduler through thread attributes, which Linux ignores for
+// threads that inherit their creator's, and always at the top priority.
+static _Thread_local bool promoted = false;
+
+static void promote(struct engine * engine, struct callback_stats * stats) {
+  promoted = true;
+  if (engine->realtimePriority > 0 && realtimePromote(engine->realtimePriority) == 0) {
+    atomic_store_explicit(&stats->realtime, engine->realtimePriority, memory_order_relaxed);
+  }
+}
+
+void engineCapture(struct engine * engine, const void * input, ma_uint32 frameCount) {
+  uint64_t start = statsBegin(&engine->captureStats);
+  ARENA_AUDIO_THREAD();
+  if (!promoted) promote(engine, &engine->captureStats);
+  capture(engine, input, frameCount);
+  statsEnd(&engine->captureStats, start, frameCount);
+}
+
+static bool audible(int mode) {
+  return mode == TRACK_PLAYING || mode == TRACK_OVERDUBBING;
+}
+
+static bool anyAudible(struct engine * engine) {
+  for (int t = 0; t < engine->tracks.count; t++) {
+    if (audible(engine->playbackMode[t])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Commands that start or end something are the ones quantizing holds back;
+// undo and redo happen as soon as they're asked for
+static bool quantized(enum command_type type) {
+  return type != CMD_UNDO && type != CMD_UNDO_LAYER && type != CMD_REDO_LAYER;
+}
+
+// Frames to the grid's next boundary, 0 if we're on one
+static ma_uint64 untilBoundary(struct engine * engine) {
+  ma_uint64 grid = engine->gridFrames, position = engine->gridPosition;
+
+  if (engine->quantize == QUANTIZE_LOOP) {
+    return position == 0 ? 0 : grid - position;
+  }
+  // beats are rounded down to the frame, so a loop that doesn't divide evenly
+  // still has its last beat end where the loop does
+  ma_uint64 beats = (ma_uint64)engine->beats;
+  ma_uint64 beat = position * beats / grid;
+  while (beat * grid / beats < position) {
+    beat++;
+  }
+  return beat * grid / beats - position;
+}
+
+// A track is starting to play. If nothing else is, its loop becomes the grid.
+static void startGrid(struct engine * engine, int track) {
+  struct tracks * tracks = &engine->tracks;
+  ma_uint64 length = atomic_load_explicit(&tracks->length[track], memory_order_acquire);
+
+  if (engine->quantize == QUANTIZE_OFF || anyAudible(engine)) {
+    return;
+  }
+  if (engine->playbackMode[track] == TRACK_RECORDING) {
+    // capture closes the take later this period, shortening it by its crossfade
+    length -= closeFade(tracks, length);
+  }
+  engine->gridFrames = length;
+  engine->gridPosition = 0;
+}
+
+// Carry out what's waiting, up to a command that isn't due for a while yet.
+// Returns how many frames can be run before the next one is.
+static ma_uint32 applyPlaybackCommands(struct engine * engine, ma_uint32 frameCount) {
+  struct tracks * tracks = &engine->tracks;
+  struct command command;
+
+  while (commandPeek(&engine->playbackQueue, &command)) {
+    int t = command.track;
+    bool onGrid = false;
+    if (quantized(command.type) && engine->quantize != QUANTIZE_OFF && engine->gridFrames > 0 && anyAudible(engine)) {
+      ma_uint64 wait = untilBoundary(engine);
+      if (wait > 0) {
+        // everything behind it waits too, so nothing overtakes it
+        return wait < frameCount ? (ma_uint32)wait : frameCount;
+      }
+      onGrid = true;
+    }
+    commandPop(&engine->playbackQueue, &command);
+    engine->playbackSequence = command.sequence;
+
+    if (onGrid && engine->playbackMode[t] == TRACK_RECORDING && command.type != CMD_RECORD) {
+      // The take ended on the boundary, so record on into the crossfade that
+      // closing it takes off again: its length stays a whole number of beats.
+      // closeFade shortens the fade on a take under two fades long, and then
+      // the run-on is the whole take, which is what the fade comes to.
+      ma_uint64 length = atomic_load_explicit(&tracks->length[t], memory_order_acquire);
+      engine->closeIn[t] = length < tracks->fadeFrames ? (ma_uint32)length : tracks->fadeFrames;
+    }
+    switch (command.type) {
+    case CMD_RECORD:
+      engine->playbackMode[t] = TRACK_RECORDING;
+      if (engine->layers != NULL) {
+        layersClear(engine->layers, t);
+      }
+      break;
+    case CMD_PLAY:
+      // a track that just started playing starts from its first frame
+      if (!audible(engine->playbackMode[t])) {
+        startGrid(engine, t);
+        tracks->cursor[t] = 0;
+        if (onGrid && engine->playbackMode[t] == TRACK_RECORDING && engine->latency > 0) {
+          // the take started on a boundary too, but what it caught then had
+          // been played along to `latency` frames earlier
+          ma_uint64 length = atomic_load_explicit(&tracks->length[t], memory_order_acquire);
+          tracks->cursor[t] = length > 0 ? engine->latency % length : 0;
+        }
+      }
+      engine->playbackMode[t] = TRACK_PLAYING;
+      if (engine->layers != NULL) {
+        layerEnd(engine->layers, t);
+      }
+      break;
+    case CMD_OVERDUB:
+      if (!audible(engine->playbackMode[t])) {
+        startGrid(engine, t);
+      }
+      engine->playbackMode[t] = TRACK_OVERDUBBING;
+      if (engine->layers != NULL) {
+        layerBegin(engine->layers, t);
+      }
+      break;
+    case CMD_STOP:
+      engine->playbackMode[t] = TRACK_STOPPED;
+      if (engine->layers != NULL) {
+        layerEnd(engine->layers, t);
+      }
+      break;
+    case CMD_MUTE:
+    case CMD_UNMUTE:
+      tracks->muted[t] = command.type == CMD_MUTE;
+      break;
+    case CMD_UNDO:
+      engine->playbackMode[t] = TRACK_STOPPED;
+      trackReset(tracks, t);
+      if (engine->layers != NULL) {
+        layersClear(engine->layers, t);
+      }
+      break;
+    case CMD_UNDO_LAYER:
+      if (engine->playbackMode[t] == TRACK_OVERDUBBING) {
+        engine->playbackMode[t] = TRACK_PLAYING;
+      }
+      if (engine->layers != NULL) {
+        layerUndo(engine->layers, tracks, t);
+      }
+      break;
+    case CMD_REDO_LAYER:
+      if (engine->layers != NULL) {
+        layerRedo(engine->layers, tracks, t);
+      }
+      break;
+    }
+  }
+  return frameCount;
+}
+
+// Mix every playing track into `output`. `input` is only there in duplex mode,
+// where overdubbing tracks take it in as they play.
+static void mixTracks(struct engine * engine, void * output, const void * input, ma_uint32 frameCount) {
+  struct tracks * tracks = &engine->tracks;
+
+  for (int t = 0; t < tracks->count; t++) {
+    int mode = engine->playbackMode[t];
+    if (mode == TRACK_OVERDUBBING && input != NULL) {
+      trackOverdub(tracks, t, output, input, frameCount, engine->feedback, engine->latency, engine->layers);
+    } else if (audible(mode)) {
+      trackMix(tracks, t, output, frameCount);
+    }
+  }
+}
+
+void enginePlayback(struct engine * engine, void * output, ma_uint32 frameCount) {
+  uint64_t start = statsBegin(&engine->playbackStats);
+  ARENA_AUDIO_THREAD();
+  if (!promoted) promote(engine, &engine->playbackStats);
+
+  // miniaudio hands us a zeroed output buffer, so every track just adds itself in
+  if (engine->calibration != NULL) {
+    calibrationPlayback(engine->calibration, output, frameCount);
+  } else {
+    applyPlaybackCommands(engine, frameCount);
+    mixTracks(engine, output, NULL, frameCount);
+  }
+  statsEnd(&engine->playbackStats, start, frameCount);
+}
+
+void engineDuplex(struct engine * engine, void * output, const void * input, ma_uint32 frameCount) {
+  uint64_t start = statsBegin(&engine->duplexStats);
+  ARENA_AUDIO_THREAD();
+  if (!promoted) promote(engine, &engine->duplexStats);
+
+  if (engine->calibration != NULL) {
+    // output first, so the chirp is stamped with where capture was at the top of this period
+    calibrationPlayback(engine->calibration, output, frameCount);
+    calibrationCapture(engine->calibration, input, frameCount);
+  } else {
+    ma_uint32 bytesPerFrame = engine->tracks.bytesPerFrame;
+    ma_uint32 done = 0;
+
+    // run the period in pieces, split wherever a quantized command falls due
+    while (done < frameCount) {
+      ma_uint32 frames = applyPlaybackCommands(engine, frameCount - done);
+      const void * in = (const char *)input + (size_t)done * bytesPerFrame;
+      void * out = (char *)output + (size_t)done * bytesPerFrame;
+
+      capture(engine, in, frames);
+      mixTracks(engine, out, in, frames);
+      if (engine->gridFrames > 0) {
+        engine->gridPosition = (engine->gridPosition + frames) % engine->gridFrames;
+      }
+      done += frames;
+    }
+
+    if (engine->monitor) {
+      mixSamples(&engine->tracks, output, input, frameCount * engine->tracks.channels, 1.0f);
+    }
+  }
+  statsEnd(&engine->duplexStats, start, frameCount);
+}
+
+void engineStatsPrint(struct engine * engine) {
+  statsPrint(&engine->captureStats);
+  statsPrint(&engine->playbackStats);
+  statsPrint(&engine->duplexStats);
+  printf("writer: %llu frames dropped from the current take\n", (unsigned long long)atomic_load(&engine->writer->droppedFrames));
+  if (engine->layers != NULL) {
+    struct layers * layers = engine->layers;
+    ma_uint32 used = atomic_load_explicit(&layers->blocksUsed, memory_order_relaxed);
+    printf("undo: %u of %u blocks in use (%.1f of %.1f s), %u layers forgotten to make room\n", used, layers->poolBlocks,
+           (double)used * LAYER_BLOCK_FRAMES / engine->tracks.sampleRate, (double)layers->poolBlocks * LAYER_BLOCK_FRAMES / engine->tracks.sampleRate,
+           atomic_load_explicit(&layers->forgotten, memory_order_relaxed));
+  }
+}
+
+uint32_t engineGlitches(struct engine * engine) {
+  return statsGlitches(&engine->captureStats) + statsGlitches(&engine->playbackStats) + statsGlitches(&engine->duplexStats);
+}
+
+void engineStatsReset(struct engine * engine) {
+  ma_uint32 sampleRate = engine->tracks.sampleRate;
+
+  statsInit(&engine->captureStats, "capture", sampleRate);
+  statsInit(&engine->playbackStats, "playback", sampleRate);
+  statsInit(&engine->duplexStats, "duplex", sampleRate);
+}
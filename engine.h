@@ -0,0 +1,176 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "miniaudio.h"
+#include "writer.h"
+#include "events.h"
+#include "commands.h"
+#include "calibrate.h"
+#include "stats.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Longest take a track can hold - every track is allocated once at startup
+#define LOOP_MAX_SECONDS 60
+
+#define TRACKS_MAX 8
+#define TRACKS_DEFAULT 4
+
+// Equal-power crossfade across each loop's wrap point
+#define LOOP_CROSSFADE_MS 10
+#define LOOP_CROSSFADE_MAX_MS 100
+
+struct layers;
+
+// Every loop track, preallocated and in memory. The capture side appends to
+// a track while it records and the playback side mixes every playing track
+// into one output bus, each wrapping at its own length, so going from
+// RECORDING to LOOPING never touches the disk.
+//
+// Per-track state is laid out as parallel arrays rather than an array of
+// structs, so the mixer walks a few small contiguous arrays however many
+// tracks there are.
+struct tracks
+{
+  ma_format format;
+  ma_uint32 channels;
+  ma_uint32 sampleRate;
+  ma_uint32 bytesPerFrame;
+  ma_uint64 capacity;                     // in frames, per track
+  int count;
+
+  void * frames[TRACKS_MAX];
+  _Atomic ma_uint64 length[TRACKS_MAX];   // frames recorded, published by the capture side
+  ma_uint64 cursor[TRACKS_MAX];           // playback position, owned by the playback side
+  float gain[TRACKS_MAX];
+  bool muted[TRACKS_MAX];                 // muted tracks keep their place, they just aren't heard
+
+  // When a take closes, its last fadeFrames are faded into its first ones and
+  // the take is shortened by that much. The faded head goes in a separate
+  // seam buffer, so playback still only ever copies: the seam for the first
+  // seamLength frames of each pass, the take itself for the rest.
+  ma_uint32 fadeFrames;
+  void * seams[TRACKS_MAX];
+  _Atomic ma_uint32 seamLength[TRACKS_MAX];   // 0 until the take is closed
+  _Atomic bool closed[TRACKS_MAX];            // the capture side is done with the take
+};
+
+ma_result tracksInit(struct tracks * tracks, int count, ma_format format, ma_uint32 channels, ma_uint32 sampleRate, ma_uint32 seconds);
+void tracksUninit(struct tracks * tracks);
+// Size of each track's loop buffer
+size_t trackBytes(struct tracks * tracks);
+bool trackFull(struct tracks * tracks, int track);
+// Start a new take, or throw one away
+void trackReset(struct tracks * tracks, int track);
+// Finish a take: fade its seam and publish its final length
+void trackClose(struct tracks * tracks, int track);
+
+// real-time safe: no locks, no allocation, no I/O
+// The stretch of a closed track from `cursor` that can be read in one go,
+// and where it is: the seam while we're in it, the take itself after that
+void * trackRun(struct tracks * tracks, int track, ma_uint64 cursor, ma_uint64 length, ma_uint32 seam, ma_uint64 * run);
+// trackWrite returns how many frames fit; fewer than asked means the track is full
+ma_uint32 trackWrite(struct tracks * tracks, int track, const void * input, ma_uint32 frameCount);
+// Add the track into `output` at its gain, or just advance its cursor if it's muted
+void trackMix(struct tracks * tracks, int track, void * output, ma_uint32 frameCount);
+// Like trackMix, but also sums `input` into the track in place:
+// loop = loop * feedback + input. The output gets the loop as it was.
+// The input goes in `latency` frames behind the cursor, where the loop was
+// when what's arriving now was played along to it. Every block is handed to
+// `layers` (if not NULL) before it changes, so the pass can be undone.
+void trackOverdub(struct tracks * tracks, int track, void * output, const void * input, ma_uint32 frameCount, float feedback, ma_uint64 latency, struct layers * layers);
+
+enum track_mode
+{
+  TRACK_STOPPED,
+  TRACK_RECORDING,
+  TRACK_PLAYING,
+  TRACK_OVERDUBBING     // duplex only - needs input and output on the same clock
+};
+
+enum quantize_mode
+{
+  QUANTIZE_OFF,
+  QUANTIZE_BEAT,        // transitions wait for the next beat of the first loop
+  QUANTIZE_LOOP         // or for the next time round it
+};
+
+// Everything the audio callbacks need. The control thread never touches audio
+// state directly: it sends commands with engineSend, and each side of the audio
+// path drains its own queue at the start of its next period and does the
+// bookkeeping (resetting the length on record, rewinding on play) on its own
+// thread, on a period boundary. Neither side ever waits on the other.
+struct engine
+{
+  struct tracks tracks;
+  struct wav_writer * writer;
+  struct event_loop * events;
+  bool monitor;                         // duplex only: pass the input straight to the output
+  float feedback;                       // how much of a track survives each overdub pass (1 = all of it)
+  ma_uint64 latency;                    // measured round trip in frames, see calibrate.h
+  struct calibration * calibration;     // while set, the callbacks run the calibration instead
+  struct layers * layers;               // overdub undo history, NULL for none
+  int realtimePriority;                 // audio threads move to SCHED_FIFO at this priority, 0 = don't
+
+  // Quantizing, duplex only. The grid is the length of the loop that started
+  // playing while nothing else was, split into `beats`. While anything is
+  // playing, commands that start or end something wait at the head of the
+  // queue until the grid's next boundary, and the period is split there so
+  // they land on the exact frame. Both sides run on the one duplex thread,
+  // so everything here belongs to it.
+  int quantize;                         // quantize_mode
+  int beats;
+  ma_uint64 gridFrames;                 // 0 until a loop starts playing
+  ma_uint64 gridPosition;               // frames into the grid
+  unsigned playbackSequence;            // the last command playback carried out; capture never gets ahead of it
+  ma_uint32 closeIn[TRACKS_MAX];        // a take that ended on a boundary records on this many frames, for its crossfade
+
+  // written by the callbacks, printed by engineStatsPrint from anywhere
+  struct callback_stats captureStats;
+  struct callback_stats playbackStats;
+  struct callback_stats duplexStats;
+
+  struct command_queue captureQueue;    // drained by engineCapture
+  struct command_queue playbackQueue;   // drained by enginePlayback
+  ma_uint64 capturedFrames;             // the capture side's clock: every frame it has been handed
+  int captureMode[TRACKS_MAX];          // track_mode as the capture side sees it
+  int playbackMode[TRACKS_MAX];         // track_mode as the playback side sees it
+
+  // what the control thread has asked for so far - only it reads these
+  unsigned sentSequence;
+  int controlMode[TRACKS_MAX];
+  bool controlMuted[TRACKS_MAX];
+};
+
+ma_result engineInit(struct engine * engine, struct wav_writer * writer, struct event_loop * events, int trackCount, ma_format format, ma_uint32 channels, ma_uint32 sampleRate, ma_uint32 seconds);
+void engineUninit(struct engine * engine);
+// false if the command couldn't be queued, in which case nothing was sent
+bool engineSend(struct engine * engine, enum command_type type, int track);
+// Whether engineSend would queue the command right now. Only the control
+// thread sends, so it still will when it gets round to it.
+bool engineCanSend(struct engine * engine, enum command_type type, int track);
+enum track_mode engineTrackMode(struct engine * engine, int track);
+bool engineTrackMuted(struct engine * engine, int track);
+// true if any track other than `except` is playing or overdubbing
+bool engineAnyPlaying(struct engine * engine, int except);
+// Overdub layers the track could undo and redo, as of the last period
+int engineUndoable(struct engine * engine, int track);
+int engineRedoable(struct engine * engine, int track);
+// Wait (up to timeoutMs) for the capture side to close the track's take, so
+// the capture device can be stopped without leaving the take half finished
+bool engineWaitClosed(struct engine * engine, int track, int timeoutMs);
+
+// Callback timing for every device that has run, plus frames the writer dropped.
+// Never blocks the audio threads, so it's safe to call at any time.
+void engineStatsPrint(struct engine * engine);
+// Glitches across every callback, and starting the count again. Only reset
+// while no device is running.
+uint32_t engineGlitches(struct engine * engine);
+void engineStatsReset(struct engine * engine);
+
+// one of these per device callback
+void engineCapture(struct engine * engine, const void * input, ma_uint32 frameCount);
+void enginePlayback(struct engine * engine, void * output, ma_uint32 frameCount);
+void engineDuplex(struct engine * engine, void * output, const void * input, ma_uint32 frameCount);
+
+#endif
@@ -0,0 +1,114 @@
+#include "events.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+
+bool eventLoopInit(struct event_loop * events, int inputFd, int tickMs) {
+  events->inputFd = inputFd;
+  events->timerFd = -1;
+  events->tickMs  = tickMs;
+
+#ifdef __linux__
+  events->notifyRead = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (events->notifyRead < 0) {
+    return false;
+  }
+  events->notifyWrite = events->notifyRead;
+
+  if (tickMs > 0) {
+    struct itimerspec period = { 0 };
+    period.it_interval.tv_sec  = tickMs / 1000;
+    period.it_interval.tv_nsec = (tickMs % 1000) * 1000000L;
+    period.it_value = period.it_interval;
+
+    events->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (events->timerFd < 0 || timerfd_settime(events->timerFd, 0, &period, NULL) != 0) {
+      eventLoopUninit(events);
+      return false;
+    }
+  }
+#else
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return false;
+  }
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, O_NONBLOCK);
+  events->notifyRead  = fds[0];
+  events->notifyWrite = fds[1];
+#endif
+  return true;
+}
+
+void eventLoopUninit(struct event_loop * events) {
+  if (events->timerFd >= 0) {
+    close(events->timerFd);
+  }
+  if (events->notifyWrite != events->notifyRead) {
+    close(events->notifyWrite);
+  }
+  close(events->notifyRead);
+  events->timerFd = events->notifyRead = events->notifyWrite = -1;
+}
+
+void eventLoopNotify(struct event_loop * events) {
+#ifdef __linux__
+  uint64_t one = 1;
+  (void)!write(events->notifyWrite, &one, sizeof(one));
+#else
+  char one = 1;
+  (void)!write(events->notifyWrite, &one, sizeof(one));
+#endif
+}
+
+int eventLoopWait(struct event_loop * events) {
+  struct pollfd fds[3];
+  int count = 0, input = -1, timer = -1, notify;
+  int timeout = -1;
+  int mask = 0;
+  char drain[64];
+
+  if (events->inputFd >= 0) {
+    input = count;
+    fds[count].fd = events->inputFd;
+    fds[count++].events = POLLIN;
+  }
+  if (events->timerFd >= 0) {
+    timer = count;
+    fds[count].fd = events->timerFd;
+    fds[count++].events = POLLIN;
+  } else if (events->tickMs > 0) {
+    timeout = events->tickMs;
+  }
+  notify = count;
+  fds[count].fd = events->notifyRead;
+  fds[count++].events = POLLIN;
+
+  int ready = poll(fds, count, timeout);
+  if (ready < 0) {
+    return errno == EINTR ? 0 : EVENT_QUIT;
+  }
+  if (ready == 0) {
+    return EVENT_TICK;
+  }
+
+  if (input >= 0 && fds[input].revents) {
+    mask |= (fds[input].revents & POLLIN) ? EVENT_INPUT : EVENT_QUIT;
+  }
+  if (timer >= 0 && (fds[timer].revents & POLLIN)) {
+    // reading resets the expiration count; missed ticks collapse into one
+    (void)!read(events->timerFd, drain, sizeof(uint64_t));
+    mask |= EVENT_TICK;
+  }
+  if (fds[notify].revents & POLLIN) {
+    while (read(events->notifyRead, drain, sizeof(drain)) > 0) {}
+    mask |= EVENT_NOTIFY;
+  }
+  return mask;
+}
@@ -0,0 +1,33 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdbool.h>
+
+// What woke the main loop up - eventLoopWait returns a mask of these
+#define EVENT_INPUT  0x1   // the input fd (stdin on the desktop) is readable
+#define EVENT_TICK   0x2   // the periodic tick fired (used for GPIO debounce)
+#define EVENT_NOTIFY 0x4   // an audio thread called eventLoopNotify
+#define EVENT_QUIT   0x8   // the input fd was closed
+
+// Blocks the control thread until something happens instead of spinning the
+// state machine. Built on poll(2); on Linux the tick is a timerfd and
+// notifications go through an eventfd, elsewhere a pipe and the poll timeout
+// stand in for them.
+struct event_loop
+{
+  int inputFd;        // -1 if there's nothing to read
+  int timerFd;        // -1 if the tick is driven by the poll timeout
+  int notifyRead;
+  int notifyWrite;    // same fd as notifyRead when it's an eventfd
+  int tickMs;         // 0 disables the tick
+};
+
+bool eventLoopInit(struct event_loop * events, int inputFd, int tickMs);
+void eventLoopUninit(struct event_loop * events);
+int eventLoopWait(struct event_loop * events);
+
+// Wake the control thread. Safe to call from the audio callbacks: it's a
+// single non-blocking write and never takes a lock.
+void eventLoopNotify(struct event_loop * events);
+
+#endif
@@ -0,0 +1,412 @@
+#include "flac.h"
+#include <string.h>
+#include <unistd.h>
+
+#define FIXED_ORDER_MAX 4
+#define PARTITION_ORDER_MAX 8
+#define RICE_PARAMETER_MAX 30     // 5-bit parameters, 31 is the escape code
+
+#define SUBFRAME_CONSTANT 0
+#define SUBFRAME_VERBATIM 1
+#define SUBFRAME_FIXED    8
+
+#define STREAMINFO_BYTES 34
+
+// How one channel of one block is going to be coded
+struct subframe_plan
+{
+  int type;
+  int order;
+  int partitionOrder;
+  int wasted;                   // low bits that are zero in every sample
+  ma_uint32 parameters[1 << PARTITION_ORDER_MAX];
+  ma_uint64 bits;               // an upper bound, so the block buffer can't overflow
+};
+
+struct bit_writer
+{
+  unsigned char * data;
+  size_t bytes;
+  ma_uint64 accumulator;
+  int bits;                     // pending in the low end of `accumulator`, always < 8 between calls
+};
+
+static void putBits(struct bit_writer * writer, ma_uint32 value, int count) {
+  if (count == 0) {
+    return;
+  }
+  writer->accumulator = (writer->accumulator << count) | ((ma_uint64)value & ((1ull << count) - 1));
+  writer->bits += count;
+  while (writer->bits >= 8) {
+    writer->bits -= 8;
+    writer->data[writer->bytes++] = (unsigned char)(writer->accumulator >> writer->bits);
+  }
+}
+
+// `count` zeros and then a one
+static void putUnary(struct bit_writer * writer, ma_uint32 count) {
+  while (count >= 32) {
+    putBits(writer, 0, 32);
+    count -= 32;
+  }
+  putBits(writer, 1, (int)count + 1);
+}
+
+static void alignToByte(struct bit_writer * writer) {
+  if (writer->bits > 0) {
+    putBits(writer, 0, 8 - writer->bits);
+  }
+}
+
+// FLAC's "UTF-8" coding of the block number
+static void putUtf8(struct bit_writer * writer, ma_uint64 value) {
+  int bytes = 2;
+
+  if (value < 0x80) {
+    putBits(writer, (ma_uint32)value, 8);
+    return;
+  }
+  while (value >= (1ull << (5 * bytes + 1))) {
+    bytes++;
+  }
+  putBits(writer, ((0xFF00u >> bytes) & 0xFF) | (ma_uint32)(value >> (6 * (bytes - 1))), 8);
+  for (int i = bytes - 2; i >= 0; i--) {
+    putBits(writer, 0x80 | (ma_uint32)((value >> (6 * i)) & 0x3F), 8);
+  }
+}
+
+static ma_uint32 crc8(const unsigned char * data, size_t size) {
+  ma_uint32 crc = 0;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= data[i];
+    for (int b = 0; b < 8; b++) {
+      crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) & 0xFF : (crc << 1) & 0xFF;
+    }
+  }
+  return crc;
+}
+
+static ma_uint32 crc16(const unsigned char * data, size_t size) {
+  ma_uint32 crc = 0;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= (ma_uint32)data[i] << 8;
+    for (int b = 0; b < 8; b++) {
+      crc = (crc & 0x8000) ? ((crc << 1) ^ 0x8005) & 0xFFFF : (crc << 1) & 0xFFFF;
+    }
+  }
+  return crc;
+}
+
+static ma_uint32 zigzag(ma_int32 residual) {
+  return ((ma_uint32)residual << 1) ^ (ma_uint32)(residual >> 31);
+}
+
+static void fixedResidual(const ma_int32 * x, ma_uint32 n, int order, ma_int32 * residual) {
+  for (ma_uint32 i = (ma_uint32)order; i < n; i++) {
+    switch (order) {
+    case 0: residual[i] = x[i]; break;
+    case 1: residual[i] = x[i] - x[i - 1]; break;
+    case 2: residual[i] = x[i] - 2 * x[i - 1] + x[i - 2]; break;
+    case 3: residual[i] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3]; break;
+    default: residual[i] = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4]; break;
+    }
+  }
+}
+
+// Rice parameter and cost for `count` residuals adding up to `sum` once
+// zigzagged. (sum >> k) is never less than the sum of each one shifted, so
+// the cost is an upper bound.
+static ma_uint64 riceBits(ma_uint64 sum, ma_uint32 count, ma_uint32 * parameter) {
+  ma_uint64 best = ~0ull;
+
+  for (ma_uint32 k = 0; k <= RICE_PARAMETER_MAX; k++) {
+    ma_uint64 bits = (ma_uint64)count * (k + 1) + (sum >> k);
+    if (bits < best) {
+      best = bits;
+      *parameter = k;
+    }
+  }
+  return best;
+}
+
+// Plan the residual coding for the partition order that comes out smallest
+static ma_uint64 planResidual(struct subframe_plan * plan, const ma_int32 * residual, ma_uint32 n, int order) {
+  ma_uint64 sums[1 << PARTITION_ORDER_MAX];
+  ma_uint32 parameters[1 << PARTITION_ORDER_MAX];
+  int maxOrder = 0;
+  ma_uint64 best = ~0ull;
+
+  while (maxOrder < PARTITION_ORDER_MAX && (n & ((2u << maxOrder) - 1)) == 0 && (n >> (maxOrder + 1)) > (ma_uint32)order) {
+    maxOrder++;
+  }
+
+  // sums for the finest partitioning, merged pairwise for each coarser one
+  ma_uint32 size = n >> maxOrder;
+  for (ma_uint32 p = 0; p < (1u << maxOrder); p++) {
+    ma_uint32 start = p == 0 ? (ma_uint32)order : p * size;
+    sums[p] = 0;
+    for (ma_uint32 i = start; i < (p + 1) * size; i++) {
+      sums[p] += zigzag(residual[i]);
+    }
+  }
+  for (int partitionOrder = maxOrder; partitionOrder >= 0; partitionOrder--) {
+    ma_uint32 partitions = 1u << partitionOrder;
+    ma_uint64 bits = 2 + 4;
+    for (ma_uint32 p = 0; p < partitions; p++) {
+      ma_uint32 count = (n >> partitionOrder) - (p == 0 ? (ma_uint32)order : 0);
+      bits += 5 + riceBits(sums[p], count, &parameters[p]);
+    }
+    if (bits < best) {
+      best = bits;
+      plan->partitionOrder = partitionOrder;
+      memcpy(plan->parameters, parameters, partitions * sizeof(parameters[0]));
+    }
+    for (ma_uint32 p = 0; p < partitions / 2; p++) {
+      sums[p] = sums[2 * p] + sums[2 * p + 1];
+    }
+  }
+  return best;
+}
+
+static void planSubframe(struct subframe_plan * plan, ma_int32 * x, ma_uint32 n, int bps, ma_int32 * residual) {
+  ma_uint32 all = 0;
+  bool constant = true;
+
+  for (ma_uint32 i = 0; i < n; i++) {
+    all |= (ma_uint32)x[i];
+    constant = constant && x[i] == x[0];
+  }
+  plan->wasted = 0;
+  if (constant) {
+    plan->type = SUBFRAME_CONSTANT;
+    plan->bits = 8 + bps;
+    return;
+  }
+  while ((all & 1) == 0) {
+    all >>= 1;
+    plan->wasted++;
+  }
+  if (plan->wasted > 0) {
+    for (ma_uint32 i = 0; i < n; i++) {
+      x[i] >>= plan->wasted;
+    }
+    bps -= plan->wasted;
+  }
+
+  plan->type = SUBFRAME_VERBATIM;
+  plan->bits = 8 + plan->wasted + (ma_uint64)n * bps;
+
+  // the order whose residual is smallest in absolute terms is nearly always
+  // the one that codes smallest
+  int order = 0;
+  ma_uint64 smallest = ~0ull;
+  for (int o = 0; o <= FIXED_ORDER_MAX && (ma_uint32)o < n; o++) {
+    ma_uint64 total = 0;
+    fixedResidual(x, n, o, residual);
+    for (ma_uint32 i = (ma_uint32)o; i < n; i++) {
+      total += zigzag(residual[i]);
+    }
+    if (total < smallest) {
+      smallest = total;
+      order = o;
+    }
+  }
+  fixedResidual(x, n, order, residual);
+  ma_uint64 bits = 8 + plan->wasted + (ma_uint64)order * bps + planResidual(plan, residual, n, order);
+  if (bits < plan->bits) {
+    plan->type = SUBFRAME_FIXED;
+    plan->order = order;
+    plan->bits = bits;
+  }
+}
+
+static void writeSubframe(struct bit_writer * writer, const struct subframe_plan * plan, const ma_int32 * x, ma_uint32 n, int bps, ma_int32 * residual) {
+  putBits(writer, 0, 1);
+  putBits(writer, (ma_uint32)(plan->type == SUBFRAME_FIXED ? SUBFRAME_FIXED | plan->order : plan->type), 6);
+  if (plan->wasted > 0) {
+    putBits(writer, 1, 1);
+    putUnary(writer, (ma_uint32)plan->wasted - 1);
+  } else {
+    putBits(writer, 0, 1);
+  }
+  bps -= plan->wasted;
+
+  if (plan->type == SUBFRAME_CONSTANT) {
+    putBits(writer, (ma_uint32)x[0], bps);
+  } else if (plan->type == SUBFRAME_VERBATIM) {
+    for (ma_uint32 i = 0; i < n; i++) {
+      putBits(writer, (ma_uint32)x[i], bps);
+    }
+  } else {
+    for (int i = 0; i < plan->order; i++) {
+      putBits(writer, (ma_uint32)x[i], bps);
+    }
+    fixedResidual(x, n, plan->order, residual);
+    putBits(writer, 1, 2);    // Rice coding with 5-bit parameters
+    putBits(writer, (ma_uint32)plan->partitionOrder, 4);
+    ma_uint32 size = n >> plan->partitionOrder;
+    for (ma_uint32 p = 0; p < (1u << plan->partitionOrder); p++) {
+      ma_uint32 k = plan->parameters[p];
+      putBits(writer, k, 5);
+      for (ma_uint32 i = p == 0 ? (ma_uint32)plan->order : p * size; i < (p + 1) * size; i++) {
+        ma_uint32 u = zigzag(residual[i]);
+        putUnary(writer, u >> k);
+        putBits(writer, u, (int)k);
+      }
+    }
+  }
+}
+
+static void streamInfo(struct flac_encoder * encoder, unsigned char * data) {
+  struct bit_writer writer = { data, 0, 0, 0 };
+
+  putBits(&writer, FLAC_BLOCK_FRAMES, 16);
+  putBits(&writer, FLAC_BLOCK_FRAMES, 16);
+  putBits(&writer, 0, 24);                        // frame sizes unknown
+  putBits(&writer, 0, 24);
+  putBits(&writer, encoder->sampleRate, 20);
+  putBits(&writer, encoder->channels - 1, 3);
+  putBits(&writer, encoder->bitsPerSample - 1, 5);
+  putBits(&writer, (ma_uint32)(encoder->totalFrames >> 32), 4);
+  putBits(&writer, (ma_uint32)encoder->totalFrames, 32);
+  memset(data + writer.bytes, 0, 16);             // no MD5
+}
+
+static bool writeAll(int fd, const unsigned char * data, size_t size) {
+  while (size > 0) {
+    ssize_t count = write(fd, data, size);
+    if (count <= 0) {
+      return false;
+    }
+    data += count;
+    size -= (size_t)count;
+  }
+  return true;
+}
+
+ma_result flacEncoderInit(struct flac_encoder * encoder, int fd, ma_uint32 channels, ma_uint32 sampleRate, ma_uint32 bitsPerSample, const ma_allocation_callbacks * allocationCallbacks) {
+  unsigned char header[8 + STREAMINFO_BYTES];
+
+  memset(encoder, 0, sizeof(*encoder));
+  if (channels < 1 || channels > FLAC_CHANNELS_MAX || (bitsPerSample != 16 && bitsPerSample != 24)) {
+    return MA_INVALID_ARGS;
+  }
+  encoder->fd            = fd;
+  encoder->channels      = channels;
+  encoder->sampleRate    = sampleRate;
+  encoder->bitsPerSample = bitsPerSample;
+  if (allocationCallbacks != NULL) {
+    encoder->allocationCallbacks = *allocationCallbacks;
+  }
+
+  // a verbatim block at 32 bits a sample is bigger than anything we write
+  encoder->outSize  = (size_t)FLAC_BLOCK_FRAMES * channels * 4 + 64;
+  encoder->planes   = ma_malloc((size_t)FLAC_BLOCK_FRAMES * (channels + 2) * sizeof(ma_int32), allocationCallbacks);
+  encoder->residual = ma_malloc((size_t)FLAC_BLOCK_FRAMES * sizeof(ma_int32), allocationCallbacks);
+  encoder->out      = ma_malloc(encoder->outSize, allocationCallbacks);
+  if (encoder->planes == NULL || encoder->residual == NULL || encoder->out == NULL) {
+    flacEncoderUninit(encoder);
+    return MA_OUT_OF_MEMORY;
+  }
+
+  memcpy(header, "fLaC", 4);
+  header[4] = 0x80;                               // last metadata block, STREAMINFO
+  header[5] = 0;
+  header[6] = 0;
+  header[7] = STREAMINFO_BYTES;
+  streamInfo(encoder, header + 8);
+  return writeAll(fd, header, sizeof(header)) ? MA_SUCCESS : MA_IO_ERROR;
+}
+
+ma_result flacEncodeBlock(struct flac_encoder * encoder, const ma_int32 * frames, ma_uint32 frameCount) {
+  struct bit_writer writer = { encoder->out, 0, 0, 0 };
+  struct subframe_plan plans[FLAC_CHANNELS_MAX + 2];
+  ma_uint32 channels = encoder->channels;
+  int bps = (int)encoder->bitsPerSample;
+  ma_uint32 n = frameCount;
+  int assignment = (int)channels - 1;
+  int first = 0, second = 1;
+
+  if (frameCount == 0 || frameCount > FLAC_BLOCK_FRAMES) {
+    return MA_INVALID_ARGS;
+  }
+  for (ma_uint32 c = 0; c < channels; c++) {
+    ma_int32 * plane = encoder->planes + c * FLAC_BLOCK_FRAMES;
+    for (ma_uint32 i = 0; i < n; i++) {
+      plane[i] = frames[i * channels + c];
+    }
+  }
+
+  if (channels == 2) {
+    // mid and side go after the two real channels
+    ma_int32 * left = encoder->planes, * right = left + FLAC_BLOCK_FRAMES;
+    ma_int32 * mid = right + FLAC_BLOCK_FRAMES, * side = mid + FLAC_BLOCK_FRAMES;
+    for (ma_uint32 i = 0; i < n; i++) {
+      mid[i] = (left[i] + right[i]) >> 1;
+      side[i] = left[i] - right[i];
+    }
+    for (int c = 0; c < 4; c++) {
+      planSubframe(&plans[c], encoder->planes + c * FLAC_BLOCK_FRAMES, n, bps + (c == 3), encoder->residual);
+    }
+    // independent, left/side, right/side (side first) or mid/side
+    ma_uint64 costs[4] = { plans[0].bits + plans[1].bits, plans[0].bits + plans[3].bits,
+                           plans[3].bits + plans[1].bits, plans[2].bits + plans[3].bits };
+    const int pairs[4][2] = { { 0, 1 }, { 0, 3 }, { 3, 1 }, { 2, 3 } };
+    int best = 0;
+    for (int m = 1; m < 4; m++) {
+      if (costs[m] < costs[best]) {
+        best = m;
+      }
+    }
+    assignment = best == 0 ? 1 : 7 + best;
+    first = pairs[best][0];
+    second = pairs[best][1];
+  } else {
+    for (ma_uint32 c = 0; c < channels; c++) {
+      planSubframe(&plans[c], encoder->planes + c * FLAC_BLOCK_FRAMES, n, bps, encoder->residual);
+    }
+  }
+
+  // frame header
+  putBits(&writer, 0xFFF8, 16);                   // sync, fixed block size
+  putBits(&writer, n == FLAC_BLOCK_FRAMES ? 12 : 7, 4);
+  putBits(&writer, 0, 4);                         // sample rate from STREAMINFO
+  putBits(&writer, (ma_uint32)assignment, 4);
+  putBits(&writer, bps == 16 ? 4 : 6, 3);
+  putBits(&writer, 0, 1);
+  putUtf8(&writer, encoder->blockNumber);
+  if (n != FLAC_BLOCK_FRAMES) {
+    putBits(&writer, n - 1, 16);
+  }
+  putBits(&writer, crc8(writer.data, writer.bytes), 8);
+
+  for (ma_uint32 c = 0; c < channels; c++) {
+    int plane = channels == 2 ? (c == 0 ? first : second) : (int)c;
+    writeSubframe(&writer, &plans[plane], encoder->planes + plane * FLAC_BLOCK_FRAMES, n, bps + (plane == 3 && channels == 2), encoder->residual);
+  }
+  alignToByte(&writer);
+  putBits(&writer, crc16(writer.data, writer.bytes), 16);
+
+  encoder->blockNumber++;
+  encoder->totalFrames += n;
+  return writeAll(encoder->fd, writer.data, writer.bytes) ? MA_SUCCESS : MA_IO_ERROR;
+}
+
+ma_result flacEncoderFinish(struct flac_encoder * encoder) {
+  unsigned char info[STREAMINFO_BYTES];
+
+  streamInfo(encoder, info);
+  return pwrite(encoder->fd, info, sizeof(info), 8) == (ssize_t)sizeof(info) ? MA_SUCCESS : MA_IO_ERROR;
+}
+
+void flacEncoderUninit(struct flac_encoder * encoder) {
+  // a zeroed copy means there were none, and miniaudio wants NULL for that
+  const ma_allocation_callbacks * callbacks = encoder->allocationCallbacks.onFree != NULL ? &encoder->allocationCallbacks : NULL;
+
+  ma_free(encoder->planes, callbacks);
+  ma_free(encoder->residual, callbacks);
+  ma_free(encoder->out, callbacks);
+  encoder->planes = NULL;
+  encoder->residual = NULL;
+  encoder->out = NULL;
+}
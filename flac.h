@@ -0,0 +1,42 @@
+#ifndef FLAC_H
+#define FLAC_H
+
+#include "miniaudio.h"
+#include <stdbool.h>
+
+// Frames per FLAC block; the last one of a stream may be shorter
+#define FLAC_BLOCK_FRAMES 4096
+#define FLAC_CHANNELS_MAX 8
+
+// A small FLAC encoder, since miniaudio only decodes FLAC. Fixed predictors
+// (orders 0 to 4, whichever leaves the smallest residual), Rice coded
+// residuals with per-partition parameters, wasted-bits detection and, for
+// stereo, whichever of left/right, left/side, right/side and mid/side comes
+// out smallest. No LPC, so it won't match the reference encoder's ratio,
+// but it's cheap enough to run in the gaps on a Pi. The MD5 in the header
+// is left unset, which the format allows.
+struct flac_encoder
+{
+  int fd;
+  ma_uint32 channels;
+  ma_uint32 sampleRate;
+  ma_uint32 bitsPerSample;      // 16 or 24
+  ma_uint64 totalFrames;
+  ma_uint64 blockNumber;
+  ma_int32 * planes;            // one block per channel, plus mid and side
+  ma_int32 * residual;
+  unsigned char * out;          // one encoded block
+  size_t outSize;
+  ma_allocation_callbacks allocationCallbacks;
+};
+
+// Writes the stream header to `fd` straight away; `allocationCallbacks` may be NULL
+ma_result flacEncoderInit(struct flac_encoder * encoder, int fd, ma_uint32 channels, ma_uint32 sampleRate, ma_uint32 bitsPerSample, const ma_allocation_callbacks * allocationCallbacks);
+// Encode up to FLAC_BLOCK_FRAMES interleaved frames, each sample a signed
+// integer of bitsPerSample bits. Only the last block may be short.
+ma_result flacEncodeBlock(struct flac_encoder * encoder, const ma_int32 * frames, ma_uint32 frameCount);
+// Fill in the stream length now it's known. Doesn't close `fd`.
+ma_result flacEncoderFinish(struct flac_encoder * encoder);
+void flacEncoderUninit(struct flac_encoder * encoder);
+
+#endif
@@ -0,0 +1,255 @@
+#include "layers.h"
+#include <stdlib.h>
+#include <string.h>
+
+ma_result layersInit(struct layers * layers, struct tracks * tracks, ma_uint32 seconds) {
+  ma_uint64 loopBlocks = (tracks->capacity + LAYER_BLOCK_FRAMES - 1) / LAYER_BLOCK_FRAMES;
+
+  memset(layers, 0, sizeof(*layers));
+  layers->blockBytes   = LAYER_BLOCK_FRAMES * tracks->bytesPerFrame;
+  layers->poolBlocks   = (ma_uint32)(((ma_uint64)tracks->sampleRate * seconds + LAYER_BLOCK_FRAMES - 1) / LAYER_BLOCK_FRAMES);
+  layers->touchedWords = (size_t)((loopBlocks + 63) / 64);
+
+  layers->pool  = malloc((size_t)layers->poolBlocks * layers->blockBytes);
+  layers->block = malloc(layers->poolBlocks * sizeof(ma_uint32));
+  layers->next  = malloc(layers->poolBlocks * sizeof(ma_uint32));
+  if ((layers->poolBlocks > 0 && (layers->pool == NULL || layers->block == NULL || layers->next == NULL))) {
+    layersUninit(layers);
+    return MA_OUT_OF_MEMORY;
+  }
+  // touch every page now so the playback callback never takes a page fault
+  memset(layers->pool, 0, (size_t)layers->poolBlocks * layers->blockBytes);
+  for (ma_uint32 i = 0; i < layers->poolBlocks; i++) {
+    layers->next[i] = i + 1 < layers->poolBlocks ? i + 1 : LAYER_NONE;
+  }
+  layers->freeHead   = layers->poolBlocks > 0 ? 0 : LAYER_NONE;
+  layers->freeBlocks = layers->poolBlocks;
+
+  for (int t = 0; t < tracks->count; t++) {
+    layers->touched[t] = calloc(layers->touchedWords, sizeof(ma_uint64));
+    if (layers->touched[t] == NULL) {
+      layersUninit(layers);
+      return MA_OUT_OF_MEMORY;
+    }
+  }
+  return MA_SUCCESS;
+}
+
+void layersUninit(struct layers * layers) {
+  free(layers->pool);
+  free(layers->block);
+  free(layers->next);
+  layers->pool = NULL;
+  layers->block = NULL;
+  layers->next = NULL;
+  for (int t = 0; t < TRACKS_MAX; t++) {
+    free(layers->touched[t]);
+    layers->touched[t] = NULL;
+  }
+}
+
+static void publish(struct layers * layers, int track) {
+  atomic_store_explicit(&layers->undoable[track], layers->applied[track], memory_order_relaxed);
+  atomic_store_explicit(&layers->redoable[track], layers->count[track] - layers->applied[track], memory_order_relaxed);
+  atomic_store_explicit(&layers->blocksUsed, layers->poolBlocks - layers->freeBlocks, memory_order_relaxed);
+}
+
+static void freeLayer(struct layers * layers, struct layer * layer) {
+  ma_uint32 slot = layer->head;
+  while (slot != LAYER_NONE) {
+    ma_uint32 next = layers->next[slot];
+    layers->next[slot] = layers->freeHead;
+    layers->freeHead = slot;
+    layers->freeBlocks++;
+    slot = next;
+  }
+  layer->head = LAYER_NONE;
+  layer->blocks = 0;
+}
+
+// Drop history[index] and close the gap
+static void removeLayer(struct layers * layers, int track, int index) {
+  struct layer * history = layers->history[track];
+
+  freeLayer(layers, &history[index]);
+  memmove(&history[index], &history[index + 1], (size_t)(layers->count[track] - index - 1) * sizeof(struct layer));
+  layers->count[track]--;
+  if (index < layers->applied[track]) {
+    layers->applied[track]--;
+  }
+}
+
+// Make room by giving up the least useful history on `track`: its oldest
+// layer that's in the loop, or failing that its last undone one. Never the
+// open layer. false if there's nothing else to give up.
+static bool forgetOne(struct layers * layers, int track) {
+  int closedApplied = layers->applied[track] - (layers->open[track] ? 1 : 0);
+
+  if (closedApplied > 0) {
+    removeLayer(layers, track, 0);
+  } else if (layers->count[track] > layers->applied[track]) {
+    removeLayer(layers, track, layers->count[track] - 1);
+  } else {
+    return false;
+  }
+  atomic_fetch_add_explicit(&layers->forgotten, 1, memory_order_relaxed);
+  publish(layers, track);
+  return true;
+}
+
+// This track's own history goes first, then other tracks'
+static bool makeRoom(struct layers * layers, struct tracks * tracks, int track) {
+  if (forgetOne(layers, track)) {
+    return true;
+  }
+  for (int t = 0; t < tracks->count; t++) {
+    if (t != track && forgetOne(layers, t)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void layersClear(struct layers * layers, int track) {
+  while (layers->count[track] > 0) {
+    removeLayer(layers, track, layers->count[track] - 1);
+  }
+  layers->open[track] = false;
+  publish(layers, track);
+}
+
+void layerBegin(struct layers * layers, int track) {
+  if (layers->open[track]) {
+    return;
+  }
+  // a new pass means the undone layers can't come back
+  while (layers->count[track] > layers->applied[track]) {
+    removeLayer(layers, track, layers->count[track] - 1);
+  }
+  if (layers->count[track] == LAYERS_MAX) {
+    removeLayer(layers, track, 0);
+    atomic_fetch_add_explicit(&layers->forgotten, 1, memory_order_relaxed);
+  }
+  struct layer * layer = &layers->history[track][layers->count[track]];
+  layer->head = LAYER_NONE;
+  layer->blocks = 0;
+  layers->count[track]++;
+  layers->applied[track]++;
+  layers->open[track] = true;
+  memset(layers->touched[track], 0, layers->touchedWords * sizeof(ma_uint64));
+  publish(layers, track);
+}
+
+void layerEnd(struct layers * layers, int track) {
+  if (!layers->open[track]) {
+    return;
+  }
+  layers->open[track] = false;
+  // a pass that never heard any input changed nothing
+  if (layers->history[track][layers->applied[track] - 1].blocks == 0) {
+    removeLayer(layers, track, layers->applied[track] - 1);
+  }
+  publish(layers, track);
+}
+
+// Copy one block of the loop into `saved`, or swap the two, following the
+// loop through its seam the way playback does
+static void transferBlock(struct tracks * tracks, int track, ma_uint32 block, unsigned char * saved, bool swap) {
+  ma_uint32 seam = atomic_load_explicit(&tracks->seamLength[track], memory_order_acquire);
+  ma_uint64 length = atomic_load_explicit(&tracks->length[track], memory_order_acquire);
+  ma_uint64 position = (ma_uint64)block * LAYER_BLOCK_FRAMES;
+  ma_uint64 end = position + LAYER_BLOCK_FRAMES < length ? position + LAYER_BLOCK_FRAMES : length;
+
+  while (position < end) {
+    ma_uint64 run;
+    unsigned char * loop = trackRun(tracks, track, position, length, seam, &run);
+    if (run > end - position) {
+      run = end - position;
+    }
+    size_t bytes = (size_t)run * tracks->bytesPerFrame;
+    if (swap) {
+      unsigned char scratch[256];
+      for (size_t done = 0; done < bytes; done += sizeof(scratch)) {
+        size_t chunk = bytes - done < sizeof(scratch) ? bytes - done : sizeof(scratch);
+        memcpy(scratch, loop + done, chunk);
+        memcpy(loop + done, saved + done, chunk);
+        memcpy(saved + done, scratch, chunk);
+      }
+    } else {
+      memcpy(saved, loop, bytes);
+    }
+    saved += bytes;
+    position += run;
+  }
+}
+
+void layerTouch(struct layers * layers, struct tracks * tracks, int track, ma_uint64 start, ma_uint32 frameCount) {
+  ma_uint64 * touched = layers->touched[track];
+
+  if (frameCount == 0) {
+    return;
+  }
+  for (ma_uint32 block = (ma_uint32)(start / LAYER_BLOCK_FRAMES); block <= (ma_uint32)((start + frameCount - 1) / LAYER_BLOCK_FRAMES); block++) {
+    if (!layers->open[track]) {
+      return;
+    }
+    if (touched[block / 64] & (1ull << (block % 64))) {
+      continue;
+    }
+    // every closed layer holds at least one block, so forgetting one is enough
+    if (layers->freeBlocks == 0 && !makeRoom(layers, tracks, track)) {
+      // this pass alone is bigger than the pool: keep it, without an undo
+      removeLayer(layers, track, layers->applied[track] - 1);
+      layers->open[track] = false;
+      atomic_fetch_add_explicit(&layers->forgotten, 1, memory_order_relaxed);
+      publish(layers, track);
+      return;
+    }
+
+    struct layer * layer = &layers->history[track][layers->applied[track] - 1];
+    ma_uint32 slot = layers->freeHead;
+    layers->freeHead = layers->next[slot];
+    layers->freeBlocks--;
+    layers->block[slot] = block;
+    layers->next[slot] = layer->head;
+    layer->head = slot;
+    layer->blocks++;
+    transferBlock(tracks, track, block, layers->pool + (size_t)slot * layers->blockBytes, false);
+    touched[block / 64] |= 1ull << (block % 64);
+    atomic_store_explicit(&layers->blocksUsed, layers->poolBlocks - layers->freeBlocks, memory_order_relaxed);
+  }
+}
+
+static void swapLayer(struct layers * layers, struct tracks * tracks, int track, struct layer * layer) {
+  for (ma_uint32 slot = layer->head; slot != LAYER_NONE; slot = layers->next[slot]) {
+    transferBlock(tracks, track, layers->block[slot], layers->pool + (size_t)slot * layers->blockBytes, true);
+  }
+}
+
+bool layerUndo(struct layers * layers, struct tracks * tracks, int track) {
+  if (layers->open[track]) {
+    int count = layers->count[track];
+    layerEnd(layers, track);
+    // the pass hadn't changed anything yet, so ending it was the undo
+    if (layers->count[track] < count) {
+      return true;
+    }
+  }
+  if (layers->applied[track] == 0) {
+    return false;
+  }
+  layers->applied[track]--;
+  swapLayer(layers, tracks, track, &layers->history[track][layers->applied[track]]);
+  publish(layers, track);
+  return true;
+}
+
+bool layerRedo(struct layers * layers, struct tracks * tracks, int track) {
+  if (layers->open[track] || layers->applied[track] == layers->count[track]) {
+    return false;
+  }
+  swapLayer(layers, tracks, track, &layers->history[track][layers->applied[track]]);
+  layers->applied[track]++;
+  publish(layers, track);
+  return true;
+}
@@ -0,0 +1,80 @@
+#ifndef LAYERS_H
+#define LAYERS_H
+
+#include "miniaudio.h"
+#include "engine.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Overdub layers are saved a block of this many frames at a time
+#define LAYER_BLOCK_FRAMES 1024
+// Default size of the pool every track's layers are saved in
+#define LAYER_UNDO_SECONDS 60
+// Layers each track keeps; past this the oldest is forgotten
+#define LAYERS_MAX 32
+#define LAYER_NONE 0xFFFFFFFFu
+
+// One overdub pass: the blocks of the loop it wrote to, as they were
+// before it (or, once it's undone, as they were after it)
+struct layer
+{
+  ma_uint32 head;               // first saved block, chained through `next`
+  ma_uint32 blocks;
+};
+
+// Undo and redo for overdub layers, copy-on-write. The first time a pass
+// writes to a block of the loop, the block is copied into the pool before
+// it changes, so a layer costs only the blocks it actually touched and a
+// punch-in over one bar saves one bar. Undoing swaps a layer's blocks with
+// the loop's: the loop gets back what it had before and the pool keeps
+// what the layer made, which is what redo swaps back in. Both are
+// O(touched blocks) and neither allocates.
+//
+// The pool is allocated up front and shared by every track. When it runs
+// out the oldest layers are forgotten (they stay in the loop, they just
+// can't be undone any more), and if one pass alone outgrows the pool it is
+// kept without an undo.
+//
+// Everything here is owned by the playback side. The control thread only
+// reads the counts it publishes.
+struct layers
+{
+  ma_uint32 blockBytes;
+  ma_uint32 poolBlocks;
+  unsigned char * pool;
+  ma_uint32 * block;            // which loop block each pool slot holds
+  ma_uint32 * next;             // the next slot in the same layer, or in the free list
+  ma_uint32 freeHead;
+  ma_uint32 freeBlocks;
+
+  size_t touchedWords;
+  ma_uint64 * touched[TRACKS_MAX];          // blocks the open layer has saved
+  struct layer history[TRACKS_MAX][LAYERS_MAX];   // oldest first
+  int count[TRACKS_MAX];                    // layers kept
+  int applied[TRACKS_MAX];                  // how many of those are in the loop
+  bool open[TRACKS_MAX];                    // history[applied - 1] is being played in
+
+  // published for the control thread
+  _Atomic int undoable[TRACKS_MAX];
+  _Atomic int redoable[TRACKS_MAX];
+  _Atomic ma_uint32 blocksUsed;
+  _Atomic ma_uint32 forgotten;              // layers that lost their undo to make room
+};
+
+// Room for `seconds` of saved audio across all tracks
+ma_result layersInit(struct layers * layers, struct tracks * tracks, ma_uint32 seconds);
+void layersUninit(struct layers * layers);
+
+// real-time safe: no locks, no allocation, no I/O
+// A new take, or none at all: the track's history goes
+void layersClear(struct layers * layers, int track);
+// Start a pass, throwing away anything that could have been redone
+void layerBegin(struct layers * layers, int track);
+void layerEnd(struct layers * layers, int track);
+// About to write frames [start, start + frameCount) of the loop, which mustn't wrap
+void layerTouch(struct layers * layers, struct tracks * tracks, int track, ma_uint64 start, ma_uint32 frameCount);
+// false if there was nothing to undo or redo
+bool layerUndo(struct layers * layers, struct tracks * tracks, int track);
+bool layerRedo(struct layers * layers, struct tracks * tracks, int track);
+
+#endif
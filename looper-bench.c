@@ -0,0 +1,283 @@
+#define MINIAUDIO_IMPLEMENTATION
+
+#include "miniaudio.h"
+#include "engine.h"
+#include "writer.h"
+#include "events.h"
+#include "stats.h"
+#include "archive.h"
+#include "layers.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+
+// Headless benchmark. Instead of opening devices it calls the engine's
+// callbacks back to back, as fast as they'll go, feeding them a synthetic
+// input and a scripted set of presses timed in audio frames, so every run
+// of the same options renders exactly the same audio. It prints how fast
+// that went, what each callback cost and a checksum of everything rendered,
+// which should only change when the audio does.
+//
+// With --flac it instead compresses a take the way --compress does, without
+// the throttle, and reports the ratio and what it cost.
+
+#define BENCH_SAMPLE_RATE_DEFAULT 44100
+#define BENCH_CHANNELS_DEFAULT 2
+#define BENCH_PERIOD_DEFAULT 256
+
+// One press, as the state machine would send it
+struct bench_event
+{
+  double at;              // seconds into the cycle
+  enum command_type type;
+  int track;
+};
+
+// A 40 second cycle that covers every path through the engine: takes on
+// three tracks, an overdub (which only takes input in --duplex) that is
+// undone and redone, mute, undo and stop. It repeats until the run is over.
+#define BENCH_CYCLE_SECONDS 40.0
+static const struct bench_event script[] = {
+  {  0.0, CMD_RECORD,     0 },
+  {  4.0, CMD_PLAY,       0 },
+  {  4.0, CMD_RECORD,     1 },
+  {  7.0, CMD_PLAY,       1 },
+  {  8.0, CMD_OVERDUB,    0 },
+  { 12.0, CMD_PLAY,       0 },
+  { 12.0, CMD_MUTE,       1 },
+  { 13.0, CMD_UNDO_LAYER, 0 },
+  { 13.5, CMD_REDO_LAYER, 0 },
+  { 14.0, CMD_UNMUTE,     1 },
+  { 16.0, CMD_RECORD,     2 },
+  { 22.5, CMD_PLAY,       2 },
+  { 24.0, CMD_UNDO,       1 },
+  { 38.0, CMD_STOP,       0 },
+  { 38.0, CMD_STOP,       2 },
+};
+
+// A chord plus a little noise, the same on every run
+void synthesize(struct tracks * tracks, void * input, ma_uint64 frame, ma_uint32 frameCount, ma_uint32 * noise) {
+  for (ma_uint32 i = 0; i < frameCount; i++) {
+    double t = (double)(frame + i) / tracks->sampleRate;
+    float tone = (float)(0.2 * sin(2.0 * M_PI * 220.0 * t) + 0.1 * sin(2.0 * M_PI * 330.0 * t));
+    for (ma_uint32 c = 0; c < tracks->channels; c++) {
+      *noise = *noise * 1664525u + 1013904223u;
+      float sample = tone + (float)(*noise >> 8) / (float)(1 << 24) * 0.02f - 0.01f;
+      if (tracks->format == ma_format_s16) {
+        ((ma_int16 *)input)[i * tracks->channels + c] = (ma_int16)(sample * 32767.0f);
+      } else {
+        ((float *)input)[i * tracks->channels + c] = sample;
+      }
+    }
+  }
+}
+
+// FNV-1a over the raw bytes
+ma_uint64 checksum(ma_uint64 hash, const void * data, size_t size) {
+  const unsigned char * bytes = (const unsigned char *)data;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+// Compress a real take, since the synthetic input says nothing about how
+// music compresses. The WAV is left where it is.
+int benchFlac(const char * wavPath) {
+  char flacPath[ARCHIVE_PATH_MAX];
+  struct archive_result result;
+  size_t length = strlen(wavPath);
+
+  snprintf(flacPath, sizeof(flacPath), "%.*s.flac", (int)(length > 4 ? length - 4 : length), wavPath);
+  uint64_t started = statsNow();
+  ma_result status = archiveCompress(wavPath, flacPath, 100, NULL, NULL, &result);
+  double seconds = (double)(statsNow() - started) / 1000000.0;
+  if (status == MA_FORMAT_NOT_SUPPORTED) {
+    printf("%s can't be compressed losslessly: it isn't s16, or f32 holding 24-bit samples.\n", wavPath);
+    return 1;
+  } else if (status != MA_SUCCESS) {
+    printf("Failed to compress %s (%s).\n", wavPath, ma_result_description(status));
+    return 1;
+  }
+
+  double minutes = (double)result.frames / result.sampleRate / 60.0;
+  printf("Compressed %.1f minutes of audio to %s in %.3f s, encoding and checking\n", minutes, flacPath, seconds);
+  printf("%.1f MB down to %.1f MB: %.1f%% of the WAV, %.2fx smaller\n", result.wavBytes / 1e6, result.flacBytes / 1e6,
+         100.0 * result.flacBytes / result.wavBytes, (double)result.wavBytes / result.flacBytes);
+  printf("%.3f s of CPU, %.3f s per minute of audio, %.2f%% of a core while recording\n", result.cpuSeconds,
+         result.cpuSeconds / minutes, 100.0 * result.cpuSeconds / (minutes * 60.0));
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  struct engine engine;
+  struct wav_writer writer;
+  struct event_loop events;
+  struct layers layers;
+  bool duplex = false;
+  int quantize = QUANTIZE_OFF;
+  double minutes = 10.0;
+  ma_uint32 period = BENCH_PERIOD_DEFAULT;
+  int trackCount = TRACKS_DEFAULT;
+  float feedback = 0.8f;
+  ma_format format = ma_format_f32;
+  int channels = BENCH_CHANNELS_DEFAULT;
+  int sampleRate = BENCH_SAMPLE_RATE_DEFAULT;
+
+  // --minutes of audio to render, --period frames per callback,
+  // --duplex drives one duplex callback instead of separate capture and playback,
+  // --quantize beat|loop (with --duplex) holds the presses for the grid,
+  // --format, --channels and --rate as for the looper itself,
+  // --flac TAKE.wav benchmarks compressing a take instead
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--minutes") == 0 && i + 1 < argc) {
+      minutes = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--period") == 0 && i + 1 < argc) {
+      period = (ma_uint32)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--tracks") == 0 && i + 1 < argc) {
+      trackCount = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--feedback") == 0 && i + 1 < argc) {
+      char * end;
+      feedback = strtof(argv[++i], &end);
+      if (end == argv[i] || *end != '\0') {
+        // not a number - the range check below turns it away
+        feedback = -1.0f;
+      }
+    } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+      i++;
+      format = strcmp(argv[i], "f32") == 0 ? ma_format_f32 : strcmp(argv[i], "s16") == 0 ? ma_format_s16 : ma_format_unknown;
+    } else if (strcmp(argv[i], "--channels") == 0 && i + 1 < argc) {
+      channels = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+      sampleRate = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--duplex") == 0) {
+      duplex = true;
+    } else if (strcmp(argv[i], "--quantize") == 0 && i + 1 < argc) {
+      i++;
+      quantize = strcmp(argv[i], "beat") == 0 ? QUANTIZE_BEAT : strcmp(argv[i], "loop") == 0 ? QUANTIZE_LOOP : -1;
+    } else if (strcmp(argv[i], "--flac") == 0 && i + 1 < argc) {
+      return benchFlac(argv[++i]);
+    } else {
+      printf("Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (period == 0 || trackCount < 3) {
+    printf("The script needs --period > 0 and at least 3 --tracks.\n");
+    return 1;
+  }
+  if (!(feedback >= 0.0f && feedback <= 1.0f)) {
+    printf("--feedback goes from 0 to 1.\n");
+    return 1;
+  }
+  if (quantize < 0 || (quantize != QUANTIZE_OFF && !duplex)) {
+    printf("--quantize is beat or loop, and needs --duplex.\n");
+    return 1;
+  }
+  if (format == ma_format_unknown || channels < 1 || channels > 8 || sampleRate < 8000 || sampleRate > 192000) {
+    printf("--format is f32 or s16, --channels 1 to 8 and --rate 8000 to 192000.\n");
+    return 1;
+  }
+
+  if (!eventLoopInit(&events, -1, 0)) {
+    printf("Failed to create event loop.\n");
+    return 1;
+  }
+  // nothing is ever opened, so the writer thread just discards what it's given
+  if (wavWriterInit(&writer, format, (ma_uint32)channels, (ma_uint32)sampleRate, NULL) != MA_SUCCESS) {
+    printf("Failed to start writer thread.\n");
+    return -4;
+  }
+  if (engineInit(&engine, &writer, &events, trackCount, writer.format, writer.channels, writer.sampleRate, LOOP_MAX_SECONDS) != MA_SUCCESS) {
+    printf("Failed to allocate %d loop tracks.\n", trackCount);
+    return -4;
+  }
+  engine.feedback = feedback;
+  engine.quantize = quantize;
+  if (layersInit(&layers, &engine.tracks, LAYER_UNDO_SECONDS) != MA_SUCCESS) {
+    printf("Failed to allocate the undo history.\n");
+    return -4;
+  }
+  engine.layers = &layers;
+
+  size_t periodBytes = (size_t)period * engine.tracks.bytesPerFrame;
+  void * input = malloc(periodBytes);
+  void * output = malloc(periodBytes);
+  if (input == NULL || output == NULL) {
+    printf("Failed to allocate buffers.\n");
+    return -4;
+  }
+
+  ma_uint64 total = (ma_uint64)(minutes * 60.0 * sampleRate);
+  ma_uint64 cycleFrames = (ma_uint64)(BENCH_CYCLE_SECONDS * sampleRate);
+  size_t scriptLength = sizeof(script) / sizeof(script[0]);
+  size_t nextEvent = 0;
+  ma_uint64 cycleStart = 0;
+  ma_uint64 outputHash = 14695981039346656037ull;
+  ma_uint64 harnessTime = 0;
+  ma_uint64 rendered = 0;
+  ma_uint32 noise = 1;
+
+  uint64_t started = statsNow();
+  for (ma_uint64 frame = 0; frame < total; frame += period) {
+    // presses land on period boundaries, like they do from the control thread
+    if (frame >= cycleStart + cycleFrames) {
+      cycleStart += cycleFrames;
+      nextEvent = 0;
+    }
+    while (nextEvent < scriptLength && frame >= cycleStart + (ma_uint64)(script[nextEvent].at * sampleRate)) {
+      if (!engineSend(&engine, script[nextEvent].type, script[nextEvent].track)) {
+        printf("Command queue full at %.1f s.\n", script[nextEvent].at);
+        return 1;
+      }
+      nextEvent++;
+    }
+
+    // making the input and checking the output isn't what we're measuring
+    uint64_t before = statsNow();
+    synthesize(&engine.tracks, input, frame, period, &noise);
+    harnessTime += statsNow() - before;
+
+    // the output buffer comes to us silent, as it does from miniaudio
+    memset(output, 0, periodBytes);
+    if (duplex) {
+      engineDuplex(&engine, output, input, period);
+    } else {
+      engineCapture(&engine, input, period);
+      enginePlayback(&engine, output, period);
+    }
+    before = statsNow();
+    outputHash = checksum(outputHash, output, periodBytes);
+    harnessTime += statsNow() - before;
+    rendered += period;
+  }
+  double seconds = (double)(statsNow() - started - harnessTime) / 1000000.0;
+
+  ma_uint64 trackHash = 14695981039346656037ull;
+  for (int t = 0; t < trackCount; t++) {
+    ma_uint64 length = atomic_load(&engine.tracks.length[t]);
+    trackHash = checksum(trackHash, &length, sizeof(length));
+    trackHash = checksum(trackHash, engine.tracks.frames[t], (size_t)(length * engine.tracks.bytesPerFrame));
+  }
+
+  printf("Rendered %.1f s of audio in %.3f s: %.0f frames/s, %.0fx real time\n",
+         (double)rendered / sampleRate, seconds, rendered / seconds, (double)rendered / sampleRate / seconds);
+  printf("%.0f ns per %u-frame period, %.2f%% of its budget\n", seconds * 1e9 / (double)(rendered / period), period,
+         100.0 * seconds / ((double)rendered / sampleRate));
+  // the xrun column means nothing here, the callbacks run back to back
+  statsPrint(&engine.captureStats);
+  statsPrint(&engine.playbackStats);
+  statsPrint(&engine.duplexStats);
+  printf("Output checksum %016llx, track checksum %016llx\n", (unsigned long long)outputHash, (unsigned long long)trackHash);
+
+  free(input);
+  free(output);
+  wavWriterUninit(&writer);
+  engineUninit(&engine);
+  layersUninit(&layers);
+  eventLoopUninit(&events);
+  return 0;
+}
@@ -1,41 +1,113 @@
 #define MINIAUDIO_IMPLEMENTATION
 
 #include "miniaudio.h"
+#include "engine.h"
+#include "writer.h"
+#include "events.h"
+#include "calibrate.h"
+#include "arena.h"
+#include "realtime.h"
+#include "native.h"
+#include "loopfile.h"
+#include "archive.h"
+#include "layers.h"
 #include <stdlib.h>
 #include <stdio.h>
-#include <sys/select.h>
-#include <sys/ioctl.h>
+#include <string.h>
 #include <termios.h>
+#include <unistd.h>
 #include <stdbool.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
 
-// SPACE BAR IS OUR BUTTON
+// bits of state.pressed
+#define BUTTON_MAIN    0x1
+#define BUTTON_OVERDUB 0x2
+#define BUTTON_SELECT  0x4
+#define BUTTON_MUTE    0x8
+#define BUTTON_UNDO    0x10
+#define BUTTON_REDO    0x20
+#define BUTTON_STATS   0x40   // not a real button, the Pi only has the signal
+#define BUTTON_QUIT    0x80   // not a button either: stdin is at its end
+
+// SPACE BAR IS OUR BUTTON, O IS THE OVERDUB BUTTON, T SELECTS THE NEXT TRACK, M MUTES IT, U UNDOES IT, R REDOES
+// S PRINTS THE CALLBACK TIMING
 #define BUFFERSIZE 2
-// we are using _kbhit here to mimic a GPIO signal on PI
+// we are using the keyboard here to mimic a GPIO signal on PI
 // it's just nice to develop most the functionality on your computer first
-// -- https://www.flipcode.com/archives/_kbhit_for_Linux.shtml
-int _kbhit() {
+// -- stdin is put in non-canonical mode in main, so the event loop wakes up on
+// every key instead of every line
+uint32_t keyPressed() {
   char buffer[BUFFERSIZE];
-  static const int STDIN = 0;
-  static bool initialized = false;
-
-  if (! initialized) {
-    // Use termios to turn off line buffering
-    struct termios term;
-    tcgetattr(STDIN, &term);
-    term.c_lflag &= ~ICANON;
-    tcsetattr(STDIN, TCSANOW, &term);
-    setbuf(stdin, NULL);
-    initialized = true;
+  uint32_t pressed = 0;
+  ssize_t count = read(STDIN_FILENO, buffer, sizeof(buffer));
+  // a file or /dev/null stays readable at its end, so poll never says it closed
+  if (count == 0 || (count < 0 && errno != EAGAIN && errno != EINTR)) {
+    return BUTTON_QUIT;
   }
-
-  int bytesWaiting;
-  ioctl(STDIN, FIONREAD, &bytesWaiting);
-  if(bytesWaiting == true) {
-    fgets(buffer, BUFFERSIZE , stdin);
+  for (ssize_t i = 0; i < count; i++) {
+    switch (buffer[i]) {
+    case 'o': case 'O': pressed |= BUTTON_OVERDUB; break;
+    case 't': case 'T': pressed |= BUTTON_SELECT; break;
+    case 'm': case 'M': pressed |= BUTTON_MUTE; break;
+    case 'u': case 'U': pressed |= BUTTON_UNDO; break;
+    case 'r': case 'R': pressed |= BUTTON_REDO; break;
+    case 's': case 'S': pressed |= BUTTON_STATS; break;
+    default: pressed |= BUTTON_MAIN; break;
+    }
   }
-  return bytesWaiting;
+  return pressed;
+}
+
+
+// kill -USR1 <pid> prints the callback timing without disturbing the audio
+static volatile sig_atomic_t statsRequested = 0;
+static struct event_loop * signalEvents;
+
+void requestStats(int signal) {
+  (void)signal;
+  statsRequested = 1;
+  // poll may be sleeping on another thread's behalf - make sure it wakes
+  eventLoopNotify(signalEvents);
+}
+
+// Ctrl-C or kill lets the main loop finish up, so the loops get saved and the
+// last take is closed. A second one kills the looper outright, in case
+// finishing up is what's stuck.
+static volatile sig_atomic_t quitRequested = 0;
+
+void requestQuit(int signal) {
+  (void)signal;
+  quitRequested = 1;
+  eventLoopNotify(signalEvents);
+}
+
+// the terminal as it was before main turned off line buffering
+static struct termios savedTerm;
+
+void restoreTerminal(void) {
+  tcsetattr(STDIN_FILENO, TCSANOW, &savedTerm);
+}
+
+void handleQuitSignals(void) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = requestQuit;
+  action.sa_flags = SA_RESETHAND;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
 }
 
+// How long to wait on the capture callback before stopping its device anyway
+#define CLOSE_TIMEOUT_MS 200
+
+// --auto-tune halves the period from the largest size down to the smallest,
+// giving the devices this long at each to show an xrun
+#define TUNE_PERIOD_MAX 2048
+#define TUNE_PERIOD_MIN 16
+#define TUNE_SECONDS 3
 
 struct state;
 typedef void state_fn(struct state *);
@@ -43,164 +115,937 @@ typedef void state_fn(struct state *);
 struct state
 {
     state_fn * next;
-    ma_decoder * outputDecoder;
-    ma_encoder * inputEncoder;
+    struct engine * engine;
+    ma_context * context;       // every device is opened through this, allocating from the arena
     ma_device * inputDevice;
     ma_device * outputDevice;
+    ma_device * duplexDevice;   // only used with --duplex, in place of the two above
+    bool duplex;
+    bool persistent;            // capture and playback run the whole time, the callbacks gate themselves
+    struct event_loop * events;
+    int track;                  // the track the buttons act on
+    uint32_t pressed;           // BUTTON_ bits set by main, cleared by the state that consumes them
+    ma_uint32 periodFrames;     // device period, 0 leaves it to miniaudio and the profile
+    ma_uint32 periods;          // periods per device buffer, 0 for the backend's default
+    ma_performance_profile profile;
+    unsigned closing;           // a bit for each track whose take's file waits on the capture side
+    ma_device_id * captureId;   // the input to record from, NULL for the default
 };
 
-state_fn enterIdle, enterRecording, recording, leaveRecording, enterLoop, looping, leaveLoop;
+state_fn enterIdle, enterRecording, recording, leaveRecording, enterLoop, looping, leaveLoop, enterOverdub, overdubbing, leaveOverdub, selectTrack, undoTake, undoLayer, redoLayer;
 
 
 void data_callback(ma_device* pDevice, void* pOutput, const void* pInput, ma_uint32 frameCount)
 {
-  ma_encoder* pEncoder = (ma_encoder*)pDevice->pUserData;
-  MA_ASSERT(pEncoder != NULL);
-  ma_encoder_write_pcm_frames(pEncoder, pInput, frameCount, NULL);
+  struct engine* pEngine = (struct engine*)pDevice->pUserData;
+  MA_ASSERT(pEngine != NULL);
+  engineCapture(pEngine, pInput, frameCount);
   (void)pOutput;
 }
 
 void data_callbackOutput(ma_device* pDevice, void* pOutput, const void* pInput, ma_uint32 frameCount)
 {
-    ma_decoder* pDecoder = (ma_decoder*)pDevice->pUserData;
-    if (pDecoder == NULL) {
+    struct engine* pEngine = (struct engine*)pDevice->pUserData;
+    if (pEngine == NULL) {
         return;
     }
 
-    /* Reading PCM frames will loop based on what we specified when called ma_data_source_set_looping(). */
-    ma_data_source_read_pcm_frames(pDecoder, pOutput, frameCount, NULL);
+    enginePlayback(pEngine, pOutput, frameCount);
 
     (void)pInput;
 }
 
+// input and output arrive in the same period, so what we record and what we
+// play back share one clock
+void data_callbackDuplex(ma_device* pDevice, void* pOutput, const void* pInput, ma_uint32 frameCount)
+{
+  struct engine* pEngine = (struct engine*)pDevice->pUserData;
+  MA_ASSERT(pEngine != NULL);
+  engineDuplex(pEngine, pOutput, pInput, frameCount);
+}
 
-void enterIdle(struct state * state){
-  if(_kbhit()) {
-    state->next = enterRecording;
-  }
+
+// Every device gets the same period size, count and profile
+void applyTiming(struct state * state, ma_device_config * config) {
+  config->periodSizeInFrames = state->periodFrames;
+  config->periods            = state->periods;
+  config->performanceProfile = state->profile;
 }
 
-void enterRecording(struct state * state) {
-  printf("Entering Recording State\n");
+// Open the capture device, unless it already is
+void openCapture(struct state * state) {
   ma_result result;
-  ma_encoder_config inputEncoderConfig;
-  inputEncoderConfig = ma_encoder_config_init(ma_encoding_format_wav, ma_format_f32, 2, 44100);
-
-  if (ma_encoder_init_file("file.wav", &inputEncoderConfig, state->inputEncoder) != MA_SUCCESS) {
-    printf("Failed to initialize output file.\n");
-    exit(-1);
-  }
 
-  if(ma_device_get_state(state->inputDevice) != ma_device_state_stopped ) {
+  if(ma_device_get_state(state->inputDevice) == ma_device_state_uninitialized) {
     ma_device_config inputDeviceConfig;
 
     // Input Device config
     inputDeviceConfig = ma_device_config_init(ma_device_type_capture);
-    inputDeviceConfig.capture.format   = state->inputEncoder->config.format;
-    inputDeviceConfig.capture.channels = state->inputEncoder->config.channels;
-    // ** Uncomment the Following lines to specify an ALSA sound input device other than the default
-    // ma_device_id inputDeviceId;
-    // strcpy(inputDeviceId.alsa, "hw");
-    // inputDeviceConfig.capture.pDeviceID = &inputDeviceId;
-    inputDeviceConfig.sampleRate       = state->inputEncoder->config.sampleRate;
+    inputDeviceConfig.capture.format   = state->engine->tracks.format;
+    inputDeviceConfig.capture.channels = state->engine->tracks.channels;
+    inputDeviceConfig.capture.pDeviceID = state->captureId;
+    inputDeviceConfig.sampleRate       = state->engine->tracks.sampleRate;
     inputDeviceConfig.dataCallback     = data_callback;
-    inputDeviceConfig.pUserData        = state->inputEncoder;
+    applyTiming(state, &inputDeviceConfig);
+    inputDeviceConfig.pUserData        = state->engine;
 
-    result = ma_device_init(NULL, &inputDeviceConfig, state->inputDevice);
+    result = ma_device_init(state->context, &inputDeviceConfig, state->inputDevice);
     if (result != MA_SUCCESS) {
       printf("Failed to initialize capture device.\n");
       exit(-2);
     }
   }
+}
+
+void startCapture(struct state * state) {
+  ma_result result;
 
+  openCapture(state);
+  // stopped since its last take, which isn't an xrun
+  if (ma_device_get_state(state->inputDevice) != ma_device_state_started) {
+    statsRestart(&state->engine->captureStats);
+  }
   result = ma_device_start(state->inputDevice);
   if (result != MA_SUCCESS) {
     ma_device_uninit(state->inputDevice);
     printf("Failed to start device.\n");
     exit(-3);
   }
-  state->next = recording;
-}
-
-void recording(struct state * state) {
-  if(_kbhit()) {
-    state->next = leaveRecording;
-  }
-}
-
-void leaveRecording(struct state * state) {
-  ma_device_stop(state->inputDevice);
-  ma_encoder_uninit(state->inputEncoder);
-  printf("Entering Loop State\n");
-  state->next = enterLoop;
 }
 
-void enterLoop(struct state * state) {
+// Open the playback device, unless it already is
+void openPlayback(struct state * state) {
   ma_device_config outputDeviceConfig;
 
-  if (ma_decoder_init_file("file.wav", NULL, state->outputDecoder) != MA_SUCCESS) {
-    printf("Could not load file.wav\n");
-    exit(-5);
-  }
-
-  ma_data_source_set_next(state->outputDecoder, state->outputDecoder);
-
-  if(ma_device_get_state(state->outputDevice) != ma_device_state_stopped ) {
+  // one playback device mixes every track - it may already be running for another one
+  if(ma_device_get_state(state->outputDevice) == ma_device_state_uninitialized) {
 
     // Output Device config
     outputDeviceConfig = ma_device_config_init(ma_device_type_playback);
-    outputDeviceConfig.playback.format   = state->outputDecoder->outputFormat;
-    outputDeviceConfig.playback.channels = state->outputDecoder->outputChannels;
-    outputDeviceConfig.sampleRate        = state->outputDecoder->outputSampleRate;
+    outputDeviceConfig.playback.format   = state->engine->tracks.format;
+    outputDeviceConfig.playback.channels = state->engine->tracks.channels;
+    outputDeviceConfig.sampleRate        = state->engine->tracks.sampleRate;
     outputDeviceConfig.dataCallback      = data_callbackOutput;
-    outputDeviceConfig.pUserData         = state->outputDecoder;
+    applyTiming(state, &outputDeviceConfig);
+    outputDeviceConfig.pUserData         = state->engine;
 
-    if (ma_device_init(NULL, &outputDeviceConfig, state->outputDevice) != MA_SUCCESS) {
+    if (ma_device_init(state->context, &outputDeviceConfig, state->outputDevice) != MA_SUCCESS) {
       printf("Failed to open playback device.\n");
-      ma_decoder_uninit(state->outputDecoder);
       exit(-6);
     }
   }
+}
 
+void startPlayback(struct state * state) {
+  openPlayback(state);
+  // it may already be playing another track, and then its callback owns the stats
+  if (ma_device_get_state(state->outputDevice) != ma_device_state_started) {
+    statsRestart(&state->engine->playbackStats);
+  }
   if (ma_device_start(state->outputDevice) != MA_SUCCESS) {
       printf("Failed to start playback device.\n");
       ma_device_uninit(state->outputDevice);
-      ma_decoder_uninit(state->outputDecoder);
       exit(-7);
   }
+}
 
+void enterIdle(struct state * state){
+  if(state->pressed & BUTTON_MAIN) {
+    state->pressed &= ~BUTTON_MAIN;
+    state->next = enterRecording;
+  } else if(state->pressed & BUTTON_SELECT) {
+    state->pressed &= ~BUTTON_SELECT;
+    state->next = selectTrack;
+  }
+}
+
+// Queue a command for the selected track. If the callbacks have fallen so far
+// behind that it doesn't fit, the press is dropped and the caller stays put.
+bool sendCommand(struct state * state, enum command_type type) {
+  if (!engineSend(state->engine, type, state->track)) {
+    printf("Track %d: The audio callbacks are behind, press ignored\n", state->track + 1);
+    return false;
+  }
+  return true;
+}
+
+// Finish the take's file on `track` in the background
+void closeTakeFile(struct state * state, int track) {
+  wavWriterClose(state->engine->writer, track);
+  ma_uint64 dropped = atomic_load(&state->engine->writer->droppedFrames);
+  if (dropped > 0) {
+    printf("Writer fell behind, %llu frames missing from the take\n", (unsigned long long)dropped);
+  }
+  state->closing &= ~(1u << track);
+}
+
+void enterRecording(struct state * state) {
+  // checked before the take's file is opened, and nothing else sends in between
+  if (!engineCanSend(state->engine, CMD_RECORD, state->track)) {
+    printf("Track %d: The audio callbacks are behind, press ignored\n", state->track + 1);
+    state->next = enterIdle;
+    return;
+  }
+  // a take still running on to its boundary keeps its own file alongside this one
+  ma_result result = wavWriterOpen(state->engine->writer, state->track);
+  if (result == MA_BUSY) {
+    printf("Track %d: Too many takes are still being written, press ignored\n", state->track + 1);
+    state->next = enterIdle;
+    return;
+  }
+  if (result != MA_SUCCESS) {
+    printf("Failed to initialize output file.\n");
+    exit(-1);
+  }
+  printf("Track %d: Entering Recording State\n", state->track + 1);
+  // the capture side starts the take on its next period
+  sendCommand(state, CMD_RECORD);
+  // with --duplex or --persistent the devices are already running
+  if (!state->persistent) {
+    startCapture(state);
+  }
+  state->next = recording;
+}
+
+void recording(struct state * state) {
+  if((state->pressed & BUTTON_MAIN) || trackFull(&state->engine->tracks, state->track)) {
+    state->pressed &= ~BUTTON_MAIN;
+    state->next = leaveRecording;
+  } else if(state->pressed & BUTTON_UNDO) {
+    state->pressed &= ~BUTTON_UNDO;
+    state->next = undoTake;
+  }
+}
+
+void leaveRecording(struct state * state) {
+  // in duplex mode playback picks up on the very next period, sample-locked to the recording
+  if (!sendCommand(state, CMD_PLAY)) {
+    state->next = recording;
+    return;
+  }
+  if (!state->persistent) {
+    // the capture side closes the take (and fades its wrap) on its next period - let it
+    if (!engineWaitClosed(state->engine, state->track, CLOSE_TIMEOUT_MS)) {
+      printf("Capture didn't close the take, the loop won't be crossfaded\n");
+    }
+    ma_device_stop(state->inputDevice);
+  }
+  // the take is already in memory - the writer thread finishes its file in the
+  // background. While the input keeps running the capture side goes on
+  // pushing the take until it gets to the command, or quantized until the
+  // take has run on past its boundary, so main closes the file once the
+  // capture side says it's done.
+  if (state->persistent || state->engine->quantize != QUANTIZE_OFF) {
+    state->closing |= 1u << state->track;
+  } else {
+    closeTakeFile(state, state->track);
+  }
+  printf("Track %d: Entering Loop State\n", state->track + 1);
+  state->next = enterLoop;
+}
+
+void enterLoop(struct state * state) {
+  if (!state->persistent) {
+    startPlayback(state);
+  }
   state->next = looping;
 }
 
 void looping(struct state * state) {
-  if(_kbhit()) {
+  if(state->pressed & BUTTON_MAIN) {
+    state->pressed &= ~BUTTON_MAIN;
     state->next = leaveLoop;
+  } else if(state->pressed & BUTTON_OVERDUB) {
+    state->pressed &= ~BUTTON_OVERDUB;
+    if (state->duplex) {
+      state->next = enterOverdub;
+    } else {
+      printf("Overdubbing needs --duplex\n");
+    }
+  } else if(state->pressed & BUTTON_MUTE) {
+    state->pressed &= ~BUTTON_MUTE;
+    bool muted = !engineTrackMuted(state->engine, state->track);
+    if (sendCommand(state, muted ? CMD_MUTE : CMD_UNMUTE)) {
+      printf("Track %d: %s\n", state->track + 1, muted ? "Muted" : "Unmuted");
+    }
+  } else if(state->pressed & BUTTON_SELECT) {
+    state->pressed &= ~BUTTON_SELECT;
+    state->next = selectTrack;
+  } else if(state->pressed & BUTTON_UNDO) {
+    state->pressed &= ~BUTTON_UNDO;
+    // overdub layers come off one at a time before the take itself goes
+    state->next = engineUndoable(state->engine, state->track) > 0 ? undoLayer : undoTake;
+  } else if(state->pressed & BUTTON_REDO) {
+    state->pressed &= ~BUTTON_REDO;
+    state->next = redoLayer;
   }
 }
 
 void leaveLoop(struct state * state) {
-  ma_device_stop(state->outputDevice);
-  ma_decoder_uninit(state->outputDecoder);
-  printf("Entering Idle State\n");
+  if (!sendCommand(state, CMD_STOP)) {
+    state->next = looping;
+    return;
+  }
+  // the playback device keeps running while any other track still plays
+  if (!state->persistent && !engineAnyPlaying(state->engine, state->track)) {
+    ma_device_stop(state->outputDevice);
+  }
+  printf("Track %d: Entering Idle State\n", state->track + 1);
   state->next = enterIdle;
 }
 
+void enterOverdub(struct state * state) {
+  // the callback starts summing the input into the track on its next period
+  if (!sendCommand(state, CMD_OVERDUB)) {
+    state->next = looping;
+    return;
+  }
+  printf("Track %d: Entering Overdub State\n", state->track + 1);
+  state->next = overdubbing;
+}
+
+void overdubbing(struct state * state) {
+  // either button ends the layer
+  if(state->pressed & (BUTTON_MAIN | BUTTON_OVERDUB)) {
+    state->pressed &= ~(BUTTON_MAIN | BUTTON_OVERDUB);
+    state->next = leaveOverdub;
+  } else if(state->pressed & BUTTON_UNDO) {
+    // scraps the layer being played in
+    state->pressed &= ~BUTTON_UNDO;
+    state->next = undoLayer;
+  }
+}
+
+void leaveOverdub(struct state * state) {
+  if (!sendCommand(state, CMD_PLAY)) {
+    state->next = overdubbing;
+    return;
+  }
+  printf("Track %d: Entering Loop State\n", state->track + 1);
+  state->next = looping;
+}
+
+// The buttons act on one track at a time; this moves them to the next one and
+// picks up wherever that track is
+void selectTrack(struct state * state) {
+  state->track = (state->track + 1) % state->engine->tracks.count;
+  if (engineTrackMode(state->engine, state->track) == TRACK_STOPPED) {
+    printf("Track %d: Idle\n", state->track + 1);
+    state->next = enterIdle;
+  } else {
+    printf("Track %d: Looping\n", state->track + 1);
+    state->next = looping;
+  }
+}
+
+// Throw the selected track's take away, whether it's still recording or already looping
+void undoTake(struct state * state) {
+  bool wasRecording = engineTrackMode(state->engine, state->track) == TRACK_RECORDING;
+
+  if (!sendCommand(state, CMD_UNDO)) {
+    state->next = wasRecording ? recording : looping;
+    return;
+  }
+  if (wasRecording && !state->persistent) {
+    ma_device_stop(state->inputDevice);
+  }
+  if (wasRecording || (state->closing & (1u << state->track))) {
+    wavWriterClose(state->engine->writer, state->track);
+    state->closing &= ~(1u << state->track);
+  }
+  if (!state->persistent && !engineAnyPlaying(state->engine, state->track)) {
+    ma_device_stop(state->outputDevice);
+  }
+  printf("Track %d: Undone, Entering Idle State\n", state->track + 1);
+  state->next = enterIdle;
+}
+
+// Take the last overdub layer back out of the loop, or the one being played in right now
+void undoLayer(struct state * state) {
+  int left = engineUndoable(state->engine, state->track) - 1;
+
+  if (sendCommand(state, CMD_UNDO_LAYER)) {
+    printf("Track %d: Layer undone, %d left, Entering Loop State\n", state->track + 1, left > 0 ? left : 0);
+  }
+  state->next = looping;
+}
+
+void redoLayer(struct state * state) {
+  if (engineRedoable(state->engine, state->track) > 0) {
+    if (sendCommand(state, CMD_REDO_LAYER)) {
+      printf("Track %d: Layer redone\n", state->track + 1);
+    }
+  } else {
+    printf("Track %d: Nothing to redo\n", state->track + 1);
+  }
+  state->next = looping;
+}
+
+// One device for both directions, started once and left running. The state
+// machine only tells the callback what to do with it.
+void startDuplex(struct state * state) {
+  ma_device_config duplexDeviceConfig;
+
+  duplexDeviceConfig = ma_device_config_init(ma_device_type_duplex);
+  duplexDeviceConfig.capture.format    = state->engine->tracks.format;
+  duplexDeviceConfig.capture.channels  = state->engine->tracks.channels;
+  duplexDeviceConfig.playback.format   = state->engine->tracks.format;
+  duplexDeviceConfig.playback.channels = state->engine->tracks.channels;
+  duplexDeviceConfig.capture.pDeviceID = state->captureId;
+  duplexDeviceConfig.sampleRate        = state->engine->tracks.sampleRate;
+  duplexDeviceConfig.dataCallback      = data_callbackDuplex;
+  applyTiming(state, &duplexDeviceConfig);
+  duplexDeviceConfig.pUserData         = state->engine;
+
+  if (ma_device_init(state->context, &duplexDeviceConfig, state->duplexDevice) != MA_SUCCESS) {
+    printf("Failed to open duplex device.\n");
+    exit(-8);
+  }
+  statsRestart(&state->engine->duplexStats);
+  if (ma_device_start(state->duplexDevice) != MA_SUCCESS) {
+    printf("Failed to start duplex device.\n");
+    ma_device_uninit(state->duplexDevice);
+    exit(-9);
+  }
+}
+
+// Look up the round trip measured for the devices we ended up with
+void loadLatency(struct state * state) {
+  char key[1024];
+
+  if (state->duplex) {
+    latencyKey(key, sizeof(key), state->duplexDevice, state->duplexDevice, state->engine->tracks.sampleRate);
+  } else {
+    latencyKey(key, sizeof(key), state->inputDevice, state->outputDevice, state->engine->tracks.sampleRate);
+  }
+  state->engine->latency = latencyLoad(key);
+  if (state->engine->latency > 0) {
+    printf("Overdubs land %llu frames early to make up for the round trip\n", (unsigned long long)state->engine->latency);
+  }
+}
+
+// Step the period down until a short run with nothing recorded shows an xrun
+// or an overrun, then settle on the last size that got through clean. The
+// devices are closed again afterwards, ready to be opened at that size.
+void runAutoTune(struct state * state) {
+  struct timespec wait = { TUNE_SECONDS, 0 };
+  ma_uint32 best = 0, last = 0;
+
+  printf("Tuning the period size, %d seconds a step...\n", TUNE_SECONDS);
+  for (ma_uint32 period = TUNE_PERIOD_MAX; period >= TUNE_PERIOD_MIN; period /= 2) {
+    state->periodFrames = period;
+    engineStatsReset(state->engine);
+    if (state->duplex) {
+      startDuplex(state);
+    } else {
+      startCapture(state);
+      startPlayback(state);
+    }
+    nanosleep(&wait, NULL);
+
+    // the backend may not go as low as we asked
+    ma_device * device = state->duplex ? state->duplexDevice : state->outputDevice;
+    ma_uint32 actual = device->playback.internalPeriodSizeInFrames;
+    ma_uint32 glitches = engineGlitches(state->engine);
+    ma_device_uninit(state->duplexDevice);
+    ma_device_uninit(state->outputDevice);
+    ma_device_uninit(state->inputDevice);
+
+    printf("  %u frames (%.1f ms): %u glitches\n", actual, 1000.0 * actual / state->engine->tracks.sampleRate, glitches);
+    if (glitches > 0 || actual == last) {
+      break;
+    }
+    best = period;
+    last = actual;
+  }
+  engineStatsReset(state->engine);
+
+  state->periodFrames = best;
+  if (best == 0) {
+    printf("Glitches even at %d frames, leaving the period to miniaudio.\n", TUNE_PERIOD_MAX);
+  } else {
+    printf("Using %u-frame periods - pass --period %u to skip tuning next time.\n", best, best);
+  }
+}
+
+// Map back the loops an earlier run saved in `dir`, already playing
+int resumeLoops(struct engine * engine, const char * dir) {
+  char path[1024];
+  int loaded = 0;
+  bool muted;
+
+  for (int t = 0; t < engine->tracks.count; t++) {
+    snprintf(path, sizeof(path), "%s/track%d.loop", dir, t + 1);
+    if (loopFileMap(&engine->tracks, t, path, &muted)) {
+      // nothing has drained the queues yet, and they hold far more than two per track
+      if (!engineSend(engine, CMD_PLAY, t) || (muted && !engineSend(engine, CMD_MUTE, t))) {
+        printf("Track %d: Couldn't queue the resumed loop\n", t + 1);
+        continue;
+      }
+      loaded++;
+    }
+  }
+  return loaded;
+}
+
+// Save every looping track for --resume, and drop any file left from a track
+// that isn't any more. The devices must be stopped.
+void saveLoops(struct engine * engine, const char * dir) {
+  char path[1024];
+  int saved = 0;
+
+  for (int t = 0; t < engine->tracks.count; t++) {
+    enum track_mode mode = engineTrackMode(engine, t);
+    snprintf(path, sizeof(path), "%s/track%d.loop", dir, t + 1);
+    if (mode == TRACK_PLAYING || mode == TRACK_OVERDUBBING) {
+      if (loopFileSave(&engine->tracks, t, engineTrackMuted(engine, t), path)) {
+        saved++;
+      } else {
+        printf("Failed to save track %d to %s.\n", t + 1, path);
+      }
+    } else {
+      unlink(path);
+    }
+  }
+  if (saved > 0) {
+    printf("Saved %d loops - --resume %s brings them back\n", saved, dir);
+  }
+}
+
+// --calibrate: send a chirp out through the devices we'd loop on, find it in
+// what comes back and save the round trip for loadLatency. Needs the output
+// audible to the input - a loopback cable, or a speaker near the mic.
+int runCalibration(struct state * state) {
+  struct calibration calibration;
+  char key[1024];
+
+  if (calibrationInit(&calibration, state->events, state->engine->tracks.format, state->engine->tracks.channels, state->engine->tracks.sampleRate) != MA_SUCCESS) {
+    printf("Failed to allocate calibration buffers.\n");
+    return -4;
+  }
+  state->engine->calibration = &calibration;
+  printf("Calibrating round-trip latency...\n");
+  if (state->duplex) {
+    startDuplex(state);
+  } else {
+    startCapture(state);
+    startPlayback(state);
+  }
+  while (!calibrationDone(&calibration)) {
+    int mask = eventLoopWait(state->events);
+    if ((mask & EVENT_QUIT) || quitRequested) break;
+    if ((mask & EVENT_INPUT) && (keyPressed() & BUTTON_QUIT)) break;
+  }
+  if (state->duplex) {
+    ma_device_stop(state->duplexDevice);
+    latencyKey(key, sizeof(key), state->duplexDevice, state->duplexDevice, state->engine->tracks.sampleRate);
+  } else {
+    ma_device_stop(state->inputDevice);
+    ma_device_stop(state->outputDevice);
+    latencyKey(key, sizeof(key), state->inputDevice, state->outputDevice, state->engine->tracks.sampleRate);
+  }
+  state->engine->calibration = NULL;
+
+  ma_int64 frames = calibrationMeasure(&calibration);
+  calibrationUninit(&calibration);
+  if (frames < 0) {
+    printf("Didn't hear the chirp come back - is the output reaching the input?\n");
+    return -10;
+  }
+  printf("Round trip: %lld frames (%.1f ms)\n", (long long)frames, 1000.0 * frames / state->engine->tracks.sampleRate);
+  if (!latencySave(key, (ma_uint64)frames)) {
+    printf("Failed to save %s.\n", CALIBRATE_FILE);
+    return -1;
+  }
+  return 0;
+}
+
 int main(int argc, char** argv)
 {
   ma_result result;
-  ma_encoder inputEncoder;
-  ma_decoder outputDecoder;
+  struct engine engine;
+  struct wav_writer writer;
+  struct event_loop events;
   ma_device inputDevice;
   ma_device outputDevice;
+  ma_device duplexDevice;
+  struct arena arena;
+  struct arena writerArena;
+  struct archive archive;
+  struct layers layers;
+  ma_context context;
+  ma_context_config contextConfig;
+  ma_allocation_callbacks allocationCallbacks;
+  ma_allocation_callbacks writerCallbacks;
+  bool duplex = false;
+  bool monitor = false;
+  bool persistent = false;
+  bool calibrate = false;
+  bool noConvert = false;
+  bool compress = false;
+  bool autoTune = false;
+  int periodFrames = 0;
+  int periods = 0;
+  const char * session = NULL;
+  bool resume = false;
+  int resumed = 0;
+  struct loop_prefault prefault = { 0 };
+  ma_performance_profile profile = ma_performance_profile_conservative;
+  int crossfadeMs = LOOP_CROSSFADE_MS;
+  int undoSeconds = LAYER_UNDO_SECONDS;
+  int quantize = QUANTIZE_OFF;
+  int beats = 4;
+  int realtimePriority = 0;
+  float feedback = 1.0f;
+  int trackCount = TRACKS_DEFAULT;
+  ma_format format = ma_format_unknown;
+  int channels = 0;
+  int sampleRate = 0;
+  struct native_config native;
+  // point this at an ALSA device such as "hw" to record from something other than the default
+  ma_device_id * captureId = NULL;
+  ma_uint32 seconds = LOOP_MAX_SECONDS;
+  struct termios term;
 
-  struct state state = { enterIdle, &outputDecoder, &inputEncoder, &inputDevice, &outputDevice };
-  printf("Entering Idle State\n");
-  while(state.next) state.next(&state);
+  // --duplex runs capture and playback on one device, --monitor also plays the input
+  // --persistent keeps separate capture and playback devices running from startup
+  // --calibrate measures the round trip through those same devices, saves it and exits
+  // --feedback sets how much of the loop is kept under each overdub layer
+  // --undo-seconds sets how much overdubbing can be undone, across all tracks (0 turns it off)
+  // --quantize beat|loop holds every start and stop for the next beat or time
+  // round of the first loop, which --beats splits into that many beats
+  // --crossfade-ms sets the fade across each loop's wrap point (0 turns it off)
+  // --realtime [priority] locks memory and runs the audio threads SCHED_FIFO
+  // --tracks and --seconds size the loop tracks, which are all allocated up front
+  // --format, --channels and --rate set what the devices, loops and takes all
+  // use; anything not given is picked from what the hardware does natively
+  // --no-convert refuses to run if miniaudio would still have to convert
+  // --session puts the takes in that directory instead of a new one under sessions/
+  // --resume carries on with that session, starting with the loops it ended with
+  // --compress turns finished takes into FLAC in the background
+  // --period and --periods set the device period in frames and how many make
+  // up its buffer, --low-latency asks the backend for small buffers, and
+  // --auto-tune finds the smallest period this rig runs without xruns
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--tracks") == 0 && i + 1 < argc) {
+      trackCount = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+      seconds = (ma_uint32)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--realtime") == 0) {
+      realtimePriority = REALTIME_PRIORITY_DEFAULT;
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        realtimePriority = atoi(argv[++i]);
+      }
+    } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+      i++;
+      format = strcmp(argv[i], "f32") == 0 ? ma_format_f32 : strcmp(argv[i], "s16") == 0 ? ma_format_s16 : ma_format_unknown;
+      if (format == ma_format_unknown) {
+        printf("--format is f32 or s16\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--channels") == 0 && i + 1 < argc) {
+      channels = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+      sampleRate = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--period") == 0 && i + 1 < argc) {
+      periodFrames = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--periods") == 0 && i + 1 < argc) {
+      periods = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--low-latency") == 0) {
+      profile = ma_performance_profile_low_latency;
+    } else if (strcmp(argv[i], "--auto-tune") == 0) {
+      autoTune = true;
+    } else if (strcmp(argv[i], "--session") == 0 && i + 1 < argc) {
+      session = argv[++i];
+    } else if (strcmp(argv[i], "--resume") == 0 && i + 1 < argc) {
+      session = argv[++i];
+      resume = true;
+    } else if (strcmp(argv[i], "--compress") == 0) {
+      compress = true;
+    } else if (strcmp(argv[i], "--no-convert") == 0) {
+      noConvert = true;
+    } else if (strcmp(argv[i], "--crossfade-ms") == 0 && i + 1 < argc) {
+      crossfadeMs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--undo-seconds") == 0 && i + 1 < argc) {
+      undoSeconds = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--quantize") == 0 && i + 1 < argc) {
+      i++;
+      quantize = strcmp(argv[i], "beat") == 0 ? QUANTIZE_BEAT : strcmp(argv[i], "loop") == 0 ? QUANTIZE_LOOP : -1;
+      if (quantize < 0) {
+        printf("--quantize is beat or loop\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--beats") == 0 && i + 1 < argc) {
+      beats = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--feedback") == 0 && i + 1 < argc) {
+      char * end;
+      feedback = strtof(argv[++i], &end);
+      if (end == argv[i] || *end != '\0') {
+        // not a number - the range check below turns it away
+        feedback = -1.0f;
+      }
+    } else if (strcmp(argv[i], "--duplex") == 0) {
+      duplex = true;
+    } else if (strcmp(argv[i], "--calibrate") == 0) {
+      calibrate = true;
+    } else if (strcmp(argv[i], "--persistent") == 0) {
+      persistent = true;
+    } else if (strcmp(argv[i], "--monitor") == 0) {
+      // hearing the input needs the output running while we record
+      duplex = monitor = true;
+    } else {
+      printf("Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  if (realtimePriority < 0 || realtimePriority > 99) {
+    printf("--realtime priority goes from 1 to 99\n");
+    return 1;
+  }
+  if (periodFrames < 0 || periodFrames > 8192 || periods < 0 || periods > 8) {
+    printf("--period goes up to 8192 frames and --periods up to 8\n");
+    return 1;
+  }
+  if (channels < 0 || channels > NATIVE_CHANNELS_MAX) {
+    printf("--channels goes from 1 to %d\n", NATIVE_CHANNELS_MAX);
+    return 1;
+  }
+  if (sampleRate != 0 && (sampleRate < NATIVE_RATE_MIN || sampleRate > NATIVE_RATE_MAX)) {
+    printf("--rate goes from %d to %d\n", NATIVE_RATE_MIN, NATIVE_RATE_MAX);
+    return 1;
+  }
+  if (undoSeconds < 0 || undoSeconds > 3600) {
+    printf("--undo-seconds goes from 0 to 3600\n");
+    return 1;
+  }
+  if (!(feedback >= 0.0f && feedback <= 1.0f)) {
+    printf("--feedback goes from 0 to 1\n");
+    return 1;
+  }
+  if (beats < 1 || beats > 64) {
+    printf("--beats goes from 1 to 64\n");
+    return 1;
+  }
+  if (quantize != QUANTIZE_OFF && !duplex) {
+    // the boundaries are counted in frames of the one clock both sides run on
+    printf("--quantize needs --duplex\n");
+    return 1;
+  }
+  if (crossfadeMs < 0 || crossfadeMs > LOOP_CROSSFADE_MAX_MS) {
+    printf("--crossfade-ms goes from 0 to %d\n", LOOP_CROSSFADE_MAX_MS);
+    return 1;
+  }
+
+  // zeroed devices read as uninitialized until the first take opens them
+  memset(&inputDevice, 0, sizeof(inputDevice));
+  memset(&outputDevice, 0, sizeof(outputDevice));
+  memset(&duplexDevice, 0, sizeof(duplexDevice));
+
+  // Use termios to turn off line buffering, and put it back however we exit
+  if (tcgetattr(STDIN_FILENO, &term) == 0) {
+    savedTerm = term;
+    atexit(restoreTerminal);
+    term.c_lflag &= ~ICANON;
+    tcsetattr(STDIN_FILENO, TCSANOW, &term);
+  }
+
+  if (!eventLoopInit(&events, STDIN_FILENO, 0)) {
+    printf("Failed to create event loop.\n");
+    return 1;
+  }
+
+  // everything miniaudio allocates from here on comes out of the arena, so
+  // once we're running nothing touches the heap
+  if (!arenaInit(&arena, ARENA_SIZE)) {
+    printf("Failed to allocate the arena.\n");
+    return -4;
+  }
+  allocationCallbacks = arenaCallbacks(&arena);
+  contextConfig = ma_context_config_init();
+  contextConfig.allocationCallbacks = allocationCallbacks;
+  if (realtimePriority > 0) {
+    contextConfig.threadPriority = ma_thread_priority_realtime;
+  }
+  if (ma_context_init(NULL, 0, &contextConfig, &context) != MA_SUCCESS) {
+    printf("Failed to initialize audio context.\n");
+    return -5;
+  }
+
+  native.format = format;
+  native.channels = (ma_uint32)channels;
+  native.sampleRate = (ma_uint32)sampleRate;
+  if (!nativeNegotiate(&context, captureId, NULL, &native)) {
+    printf("The devices have no setting in common that the looper can use as is.\n");
+  }
+  printf("Running %s, %u channels, %u Hz\n", native.format == ma_format_s16 ? "s16" : "f32", native.channels, native.sampleRate);
 
+  // the writer's ring grows with the format, so it has an arena of its own
+  if (!arenaInit(&writerArena, wavWriterBytes(native.format, native.channels, native.sampleRate))) {
+    printf("Failed to allocate the writer's arena.\n");
+    return -4;
+  }
+  writerCallbacks = arenaCallbacks(&writerArena);
+  result = wavWriterInit(&writer, native.format, native.channels, native.sampleRate, &writerCallbacks);
+  if (result != MA_SUCCESS) {
+    printf("Failed to start writer thread.\n");
+    return -4;
+  }
+  result = engineInit(&engine, &writer, &events, trackCount, writer.format, writer.channels, writer.sampleRate, seconds);
+  if (result != MA_SUCCESS) {
+    printf("Failed to allocate %d loop tracks.\n", trackCount);
+    return -4;
+  }
+  if (undoSeconds > 0) {
+    if (layersInit(&layers, &engine.tracks, (ma_uint32)undoSeconds) != MA_SUCCESS) {
+      printf("Failed to allocate %d seconds of undo history.\n", undoSeconds);
+      return -4;
+    }
+    engine.layers = &layers;
+  }
+  engine.monitor = monitor;
+  engine.feedback = feedback;
+  engine.quantize = quantize;
+  engine.beats = beats;
+  engine.tracks.fadeFrames = engine.tracks.sampleRate * crossfadeMs / 1000;
+  if (resume) {
+    uint64_t started = statsNow();
+    resumed = resumeLoops(&engine, session);
+    printf("Resumed %d loops from %s in %.1f ms\n", resumed, session, (statsNow() - started) / 1000.0);
+  }
+  engine.realtimePriority = realtimePriority;
+  if (realtimePriority > 0) {
+    // everything's allocated now, and no device has started yet
+    realtimeSetup(&engine.tracks, realtimePriority);
+  }
+
+  signalEvents = &events;
+  signal(SIGUSR1, requestStats);
+  handleQuitSignals();
+
+  struct state state = { enterIdle, &engine, &context, &inputDevice, &outputDevice, &duplexDevice, duplex, duplex || persistent, &events, 0, 0, (ma_uint32)periodFrames, (ma_uint32)periods, profile, 0, captureId };
+  if (autoTune) {
+    runAutoTune(&state);
+  }
+  if (calibrate) {
+    result = runCalibration(&state);
+    ma_device_uninit(&duplexDevice);
+    ma_device_uninit(&outputDevice);
+    ma_device_uninit(&inputDevice);
+    eventLoopUninit(&events);
+    ma_context_uninit(&context);
+    wavWriterUninit(&writer);
+    engineUninit(&engine);
+    if (engine.layers != NULL) {
+      layersUninit(&layers);
+    }
+    arenaUninit(&writerArena);
+    arenaUninit(&arena);
+    return result;
+  }
+  if (wavWriterSession(&writer, session) != MA_SUCCESS) {
+    printf("Failed to set up the session directory %s.\n", writer.sessionDir);
+    return -4;
+  }
+  printf("Session: %s\n", writer.sessionDir);
+  if (duplex) {
+    startDuplex(&state);
+  } else if (persistent) {
+    // pay the stream start-up cost once, here, instead of on every press
+    startCapture(&state);
+    startPlayback(&state);
+  } else {
+    // opened now so we know which devices the saved latency is for, started on demand
+    openCapture(&state);
+    openPlayback(&state);
+  }
+  // every device is open by now, so this is the last word on conversion
+  bool converts = duplex ? nativeConverts(&duplexDevice) : nativeConverts(&inputDevice) | nativeConverts(&outputDevice);
+  if (converts && noConvert) {
+    printf("Refusing to run with conversion in the callbacks (--no-convert).\n");
+    ma_device_uninit(&duplexDevice);
+    ma_device_uninit(&outputDevice);
+    ma_device_uninit(&inputDevice);
+    eventLoopUninit(&events);
+    ma_context_uninit(&context);
+    wavWriterUninit(&writer);
+    engineUninit(&engine);
+    if (engine.layers != NULL) {
+      layersUninit(&layers);
+    }
+    arenaUninit(&writerArena);
+    arenaUninit(&arena);
+    return -11;
+  }
+  if (compress) {
+    if (archiveInit(&archive, &allocationCallbacks) != MA_SUCCESS) {
+      printf("Failed to start archive thread.\n");
+      return -4;
+    }
+    // takes are handed over as they close, plus any a previous run left behind
+    writer.archive = &archive;
+    archiveSweep(&archive, writer.sessionDir);
+  }
+  loadLatency(&state);
+  if (resumed > 0) {
+    // the loops play from the page cache as it fills, this gets the rest in
+    loopFilePrefaultStart(&prefault, &engine.tracks);
+    if (!state.persistent) {
+      startPlayback(&state);
+    }
+  }
+  if (engineTrackMode(&engine, 0) == TRACK_STOPPED) {
+    printf("Track 1: Entering Idle State\n");
+  } else {
+    printf("Track 1: Looping\n");
+    state.next = looping;
+  }
+  while(state.next) {
+    // run transitions until the machine settles in a state that waits on the button
+    state_fn * waiting;
+    do {
+      waiting = state.next;
+      state.next(&state);
+    } while(state.next && state.next != waiting);
+
+    // then sleep until there's something for it to look at
+    int mask = eventLoopWait(&events);
+    if ((mask & EVENT_QUIT) || quitRequested) break;
+    for (int t = 0; state.closing != 0 && t < engine.tracks.count; t++) {
+      if ((state.closing & (1u << t)) && engineWaitClosed(&engine, t, 0)) {
+        closeTakeFile(&state, t);
+      }
+    }
+    if (mask & EVENT_INPUT) {
+      state.pressed = keyPressed();
+      if (state.pressed & BUTTON_QUIT) break;
+    }
+    if (statsRequested || (state.pressed & BUTTON_STATS)) {
+      statsRequested = 0;
+      state.pressed &= ~BUTTON_STATS;
+      engineStatsPrint(&engine);
+    }
+  }
+
+  ma_device_uninit(&duplexDevice);
   ma_device_uninit(&outputDevice);
   ma_device_uninit(&inputDevice);
-  ma_encoder_uninit(&inputEncoder);
-  ma_decoder_uninit(&outputDecoder);
+  loopFilePrefaultStop(&prefault);
+  saveLoops(&engine, writer.sessionDir);
+  engineStatsPrint(&engine);
+  eventLoopUninit(&events);
+  ma_context_uninit(&context);
+  wavWriterUninit(&writer);
+  // after the writer, which hands over the last take as it closes
+  if (compress) {
+    archiveUninit(&archive);
+  }
+  engineUninit(&engine);
+  if (engine.layers != NULL) {
+    layersUninit(&layers);
+  }
+  arenaUninit(&writerArena);
+  arenaUninit(&arena);
 
   return 0;
 }
\ No newline at end of file
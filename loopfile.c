@@ -0,0 +1,164 @@
+#include "loopfile.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static bool writeAll(int fd, const void * data, size_t bytes) {
+  const char * from = (const char *)data;
+
+  while (bytes > 0) {
+    ssize_t count = write(fd, from, bytes);
+    if (count <= 0) {
+      return false;
+    }
+    from += count;
+    bytes -= (size_t)count;
+  }
+  return true;
+}
+
+bool loopFileSave(struct tracks * tracks, int track, bool muted, const char * path) {
+  char temporary[1024];
+  unsigned char page[LOOP_FILE_HEADER_BYTES];
+  struct loop_file_header header;
+  ma_uint64 length = atomic_load(&tracks->length[track]);
+  ma_uint32 seam = atomic_load(&tracks->seamLength[track]);
+  bool ok;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, LOOP_FILE_MAGIC, sizeof(header.magic));
+  header.format     = tracks->format;
+  header.channels   = tracks->channels;
+  header.sampleRate = tracks->sampleRate;
+  header.muted      = muted;
+  header.frames     = length;
+  memset(page, 0, sizeof(page));
+  memcpy(page, &header, sizeof(header));
+
+  // written alongside and renamed over, so a loaded loop still mapped from
+  // the old file keeps its pages
+  snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+  int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  ok = writeAll(fd, page, sizeof(page)) &&
+       writeAll(fd, tracks->seams[track], (size_t)seam * tracks->bytesPerFrame) &&
+       writeAll(fd, (char *)tracks->frames[track] + (size_t)seam * tracks->bytesPerFrame, (size_t)(length - seam) * tracks->bytesPerFrame) &&
+       fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+  return ok && rename(temporary, path) == 0;
+}
+
+bool loopFileMap(struct tracks * tracks, int track, const char * path, bool * muted) {
+  struct loop_file_header header;
+  struct stat status;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      printf("Couldn't open %s: %s\n", path, strerror(errno));
+    }
+    return false;
+  }
+  if (read(fd, &header, sizeof(header)) != (ssize_t)sizeof(header) ||
+      memcmp(header.magic, LOOP_FILE_MAGIC, sizeof(header.magic)) != 0) {
+    printf("%s isn't a loop this looper saved\n", path);
+    close(fd);
+    return false;
+  }
+  if (header.format != (ma_uint32)tracks->format || header.channels != tracks->channels || header.sampleRate != tracks->sampleRate) {
+    printf("%s was saved at %s, %u channels, %u Hz\n", path, header.format == ma_format_s16 ? "s16" : "f32", header.channels, header.sampleRate);
+    close(fd);
+    return false;
+  }
+  if (header.frames == 0 || header.frames > tracks->capacity) {
+    printf("%s doesn't fit in a track - try a larger --seconds\n", path);
+    close(fd);
+    return false;
+  }
+  // pages mapped past the end of the file fault with SIGBUS when touched
+  if (fstat(fd, &status) != 0 || (ma_uint64)status.st_size < LOOP_FILE_HEADER_BYTES + header.frames * tracks->bytesPerFrame) {
+    printf("%s is cut short\n", path);
+    close(fd);
+    return false;
+  }
+
+  // whole pages: the last one runs past the end of the file, and the kernel
+  // fills that part with zeroes
+  size_t bytes = (size_t)(header.frames * tracks->bytesPerFrame);
+  size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  size_t mapped = (bytes + pageSize - 1) / pageSize * pageSize;
+  if (LOOP_FILE_HEADER_BYTES % pageSize != 0) {
+    printf("Can't map %s: %zu-byte pages are bigger than its header\n", path, pageSize);
+    close(fd);
+    return false;
+  }
+  char * frames = mmap(tracks->frames[track], mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, LOOP_FILE_HEADER_BYTES);
+  int error = errno;
+  close(fd);
+  if (frames == MAP_FAILED) {
+    printf("Couldn't map %s: %s\n", path, strerror(error));
+    // a failed MAP_FIXED may have taken the old pages with it - put back
+    // fresh ones, touched like tracksInit's
+    frames = mmap(tracks->frames[track], mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if (frames != MAP_FAILED) {
+      memset(frames, 0, mapped);
+    }
+    return false;
+  }
+  // read ahead while the rest of startup carries on
+  madvise(frames, mapped, MADV_WILLNEED);
+
+  *muted = header.muted != 0;
+  atomic_store_explicit(&tracks->closed[track], true, memory_order_relaxed);
+  atomic_store_explicit(&tracks->seamLength[track], 0, memory_order_release);
+  atomic_store_explicit(&tracks->length[track], header.frames, memory_order_release);
+  return true;
+}
+
+static void * prefaultThread(void * arg) {
+  struct loop_prefault * prefault = (struct loop_prefault *)arg;
+  size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+
+  // a page at a time across all the tracks, so each is ready near the start
+  // of its loop before any is ready near the end
+  for (size_t offset = 0; !atomic_load_explicit(&prefault->stop, memory_order_relaxed); offset += pageSize) {
+    bool more = false;
+    for (int t = 0; t < prefault->tracks->count; t++) {
+      if (offset < prefault->bytes[t]) {
+        __atomic_fetch_or((ma_uint32 *)((char *)prefault->tracks->frames[t] + offset), 0, __ATOMIC_RELAXED);
+        more = true;
+      }
+    }
+    if (!more) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+void loopFilePrefaultStart(struct loop_prefault * prefault, struct tracks * tracks) {
+  bool any = false;
+
+  prefault->tracks = tracks;
+  atomic_store(&prefault->stop, false);
+  for (int t = 0; t < TRACKS_MAX; t++) {
+    prefault->bytes[t] = t < tracks->count ? (size_t)(atomic_load(&tracks->length[t]) * tracks->bytesPerFrame) : 0;
+    any = any || prefault->bytes[t] > 0;
+  }
+  // without the thread the audio thread takes the faults, which still works
+  prefault->running = any && pthread_create(&prefault->thread, NULL, prefaultThread, prefault) == 0;
+}
+
+void loopFilePrefaultStop(struct loop_prefault * prefault) {
+  if (prefault->running) {
+    atomic_store(&prefault->stop, true);
+    pthread_join(prefault->thread, NULL);
+    prefault->running = false;
+  }
+}
@@ -0,0 +1,57 @@
+#ifndef LOOPFILE_H
+#define LOOPFILE_H
+
+#include "engine.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// The header is padded out to the largest page size we run on (64 KB
+// arm64 kernels; the Pi 5's are 16 KB), so the frames after it start on a
+// page boundary and can be mapped straight into a loop buffer
+#define LOOP_FILE_HEADER_BYTES 65536
+#define LOOP_FILE_MAGIC "DUOLOOP2"
+
+// One track's loop as it plays, saved raw in the session when the looper
+// exits: no chunks to parse and nothing to decode. Loading it maps the file
+// copy-on-write over the start of the track's buffer and asks the kernel to
+// start reading it in, so it's ready to play in milliseconds. Overdubs copy
+// the pages they touch and leave the file alone.
+struct loop_file_header
+{
+  char magic[8];
+  ma_uint32 format;
+  ma_uint32 channels;
+  ma_uint32 sampleRate;
+  ma_uint32 muted;
+  ma_uint64 frames;
+};
+
+// Control thread only, with the track neither recording nor overdubbing.
+// The crossfaded head is written in place of the raw one, so the file is
+// exactly what was heard.
+bool loopFileSave(struct tracks * tracks, int track, bool muted, const char * path);
+// Map a saved loop into a track that isn't playing. Fails quietly if there's
+// no file, and says why if there is one that can't be loaded: saved at
+// another format, too long, cut short, or not mappable.
+bool loopFileMap(struct tracks * tracks, int track, const char * path, bool * muted);
+
+// Walks the mapped loops a page at a time on a thread of its own while they
+// play, reading each page in and giving the track its own copy, so the
+// audio thread doesn't take the page faults on the loop's first time round
+// or its first overdub. Each page is touched with an atomic OR of zero,
+// which can't undo an overdub that writes the page at the same moment.
+struct loop_prefault
+{
+  pthread_t thread;
+  struct tracks * tracks;
+  size_t bytes[TRACKS_MAX];     // how much of each track is mapped, 0 for none
+  _Atomic bool stop;
+  bool running;
+};
+
+// Start on the tracks loopFileMap has filled. Stop before the tracks go.
+void loopFilePrefaultStart(struct loop_prefault * prefault, struct tracks * tracks);
+void loopFilePrefaultStop(struct loop_prefault * prefault);
+
+#endif
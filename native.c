@@ -0,0 +1,105 @@
+#include "native.h"
+#include <stdio.h>
+
+#define NATIVE_CANDIDATES (2 + 64)
+
+// ma_format_unknown, 0 channels and 0Hz in a native format mean "anything"
+static bool supports(const ma_device_info * info, ma_format format, ma_uint32 channels, ma_uint32 sampleRate) {
+  for (ma_uint32 i = 0; i < info->nativeDataFormatCount; i++) {
+    if ((info->nativeDataFormats[i].format == ma_format_unknown || info->nativeDataFormats[i].format == format) &&
+        (info->nativeDataFormats[i].channels == 0 || info->nativeDataFormats[i].channels == channels) &&
+        (info->nativeDataFormats[i].sampleRate == 0 || info->nativeDataFormats[i].sampleRate == sampleRate)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The preferred values first, then anything the capture device lists that
+// the looper could have been given on the command line
+static ma_uint32 candidates(ma_uint32 * out, ma_uint32 first, ma_uint32 second, const ma_device_info * info, bool rates) {
+  ma_uint32 count = 0;
+  ma_uint32 lowest = rates ? NATIVE_RATE_MIN : 1;
+  ma_uint32 highest = rates ? NATIVE_RATE_MAX : NATIVE_CHANNELS_MAX;
+
+  out[count++] = first;
+  out[count++] = second;
+  for (ma_uint32 i = 0; i < info->nativeDataFormatCount; i++) {
+    ma_uint32 value = rates ? info->nativeDataFormats[i].sampleRate : info->nativeDataFormats[i].channels;
+    if (value >= lowest && value <= highest) {
+      out[count++] = value;
+    }
+  }
+  return count;
+}
+
+bool nativeNegotiate(ma_context * context, const ma_device_id * captureId, const ma_device_id * playbackId, struct native_config * config) {
+  ma_device_info capture, playback;
+  ma_format formats[2] = { ma_format_f32, ma_format_s16 };
+  ma_uint32 channels[NATIVE_CANDIDATES], rates[NATIVE_CANDIDATES];
+  ma_uint32 formatCount = 2, channelCount = 1, rateCount = 1;
+
+  if (ma_context_get_device_info(context, ma_device_type_capture, captureId, &capture) != MA_SUCCESS ||
+      ma_context_get_device_info(context, ma_device_type_playback, playbackId, &playback) != MA_SUCCESS) {
+    printf("Couldn't ask the devices what they support natively.\n");
+    capture.nativeDataFormatCount = playback.nativeDataFormatCount = 0;
+  }
+
+  // the engine only has kernels for f32 and s16
+  if (config->format != ma_format_unknown) {
+    formats[0] = config->format;
+    formatCount = 1;
+  }
+  if (config->channels != 0) {
+    channels[0] = config->channels;
+  } else {
+    channelCount = candidates(channels, 2, 1, &capture, false);
+  }
+  if (config->sampleRate != 0) {
+    rates[0] = config->sampleRate;
+  } else {
+    rateCount = candidates(rates, 44100, 48000, &capture, true);
+  }
+
+  for (ma_uint32 f = 0; f < formatCount; f++) {
+    for (ma_uint32 c = 0; c < channelCount; c++) {
+      for (ma_uint32 r = 0; r < rateCount; r++) {
+        if (supports(&capture, formats[f], channels[c], rates[r]) && supports(&playback, formats[f], channels[c], rates[r])) {
+          config->format = formats[f];
+          config->channels = channels[c];
+          config->sampleRate = rates[r];
+          return true;
+        }
+      }
+    }
+  }
+  config->format = formats[0];
+  config->channels = channels[0];
+  config->sampleRate = rates[0];
+  return false;
+}
+
+static bool report(const char * side, ma_format format, ma_uint32 channels, ma_uint32 sampleRate,
+                   ma_format internalFormat, ma_uint32 internalChannels, ma_uint32 internalSampleRate) {
+  if (format == internalFormat && channels == internalChannels && sampleRate == internalSampleRate) {
+    return false;
+  }
+  printf("%s device runs %s, %u channels, %u Hz - converting to %s, %u channels, %u Hz in every callback\n",
+         side, ma_get_format_name(internalFormat), internalChannels, internalSampleRate,
+         ma_get_format_name(format), channels, sampleRate);
+  return true;
+}
+
+bool nativeConverts(ma_device * device) {
+  bool converts = false;
+
+  if (device->type == ma_device_type_capture || device->type == ma_device_type_duplex) {
+    converts |= report("Capture", device->capture.format, device->capture.channels, device->sampleRate,
+                       device->capture.internalFormat, device->capture.internalChannels, device->capture.internalSampleRate);
+  }
+  if (device->type == ma_device_type_playback || device->type == ma_device_type_duplex) {
+    converts |= report("Playback", device->playback.format, device->playback.channels, device->sampleRate,
+                       device->playback.internalFormat, device->playback.internalChannels, device->playback.internalSampleRate);
+  }
+  return converts;
+}
@@ -0,0 +1,34 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#include "miniaudio.h"
+#include <stdbool.h>
+
+// What --channels and --rate take, and so all negotiation may settle on: the
+// takes' FLAC encoder stops at FLAC_CHANNELS_MAX
+#define NATIVE_CHANNELS_MAX 8
+#define NATIVE_RATE_MIN 8000
+#define NATIVE_RATE_MAX 192000
+
+// What the devices, loops and takes run at. Anything miniaudio has to
+// convert between this and what the hardware does happens inside every
+// callback, so we try to pick something both default devices do natively.
+struct native_config
+{
+  ma_format format;       // ma_format_unknown until chosen
+  ma_uint32 channels;     // 0 until chosen
+  ma_uint32 sampleRate;   // 0 until chosen
+};
+
+// Fill in whatever the user left open with a setting the capture and
+// playback devices (NULL for the defaults - pass what the devices will be
+// opened with) both support natively, preferring f32, stereo and 44100 when
+// they're on offer. Returns false, with the gaps filled from those
+// defaults, if there's no such setting and miniaudio will convert.
+bool nativeNegotiate(ma_context * context, const ma_device_id * captureId, const ma_device_id * playbackId, struct native_config * config);
+
+// After ma_device_init: true if miniaudio has put a converter between the
+// device and our callback, in which case it says what it converts
+bool nativeConverts(ma_device * device);
+
+#endif
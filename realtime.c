@@ -0,0 +1,83 @@
+#include "realtime.h"
+#include "engine.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+enum realtime_lock realtimeLockMemory(struct tracks * tracks) {
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+    return REALTIME_LOCKED_ALL;
+  }
+  // usually RLIMIT_MEMLOCK - the loop buffers are what page faults would hurt most
+  for (int t = 0; t < tracks->count; t++) {
+    if (mlock(tracks->frames[t], trackBytes(tracks)) != 0) {
+      return REALTIME_LOCKED_NOTHING;
+    }
+    if (mlock(tracks->seams[t], (size_t)tracks->sampleRate * LOOP_CROSSFADE_MAX_MS / 1000 * tracks->bytesPerFrame) != 0) {
+      return REALTIME_LOCKED_NOTHING;
+    }
+  }
+  return REALTIME_LOCKED_TRACKS;
+}
+
+static void * probeThread(void * arg) {
+  (void)arg;
+  return NULL;
+}
+
+int realtimeProbe(int priority) {
+  pthread_attr_t attr;
+  struct sched_param param;
+  pthread_t thread;
+  int result;
+
+  // a thread that starts and exits at the priority the audio threads will ask for
+  pthread_attr_init(&attr);
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = priority;
+  pthread_attr_setschedparam(&attr, &param);
+  result = pthread_create(&thread, &attr, probeThread, NULL);
+  pthread_attr_destroy(&attr);
+  if (result == 0) {
+    pthread_join(thread, NULL);
+  }
+  return result;
+}
+
+int realtimePromote(int priority) {
+  struct sched_param param;
+  volatile char stack[REALTIME_STACK_PREFAULT];
+
+  memset((char *)stack, 0, sizeof(stack));
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = priority;
+  return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+}
+
+void realtimeSetup(struct tracks * tracks, int priority) {
+  size_t loopBytes = trackBytes(tracks) * tracks->count;
+
+  switch (realtimeLockMemory(tracks)) {
+  case REALTIME_LOCKED_ALL:
+    printf("Realtime: all memory locked, %zu MB of loop buffers prefaulted\n", loopBytes >> 20);
+    break;
+  case REALTIME_LOCKED_TRACKS:
+    printf("Realtime: mlockall refused (%s), %zu MB of loop buffers locked and prefaulted\n", strerror(errno), loopBytes >> 20);
+    break;
+  case REALTIME_LOCKED_NOTHING:
+    printf("Realtime: memory not locked (%s), loop buffers prefaulted only - raise the memlock limit or run as root\n", strerror(errno));
+    break;
+  }
+
+  int result = realtimeProbe(priority);
+  if (result == 0) {
+    printf("Realtime: SCHED_FIFO priority %d available for the audio threads\n", priority);
+  } else {
+    printf("Realtime: SCHED_FIFO priority %d refused (%s) - audio threads stay on the normal scheduler\n", priority, strerror(result));
+  }
+}
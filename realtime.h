@@ -0,0 +1,36 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct tracks;
+
+#define REALTIME_PRIORITY_DEFAULT 70
+// How much of its stack an audio thread touches when it's promoted, so a
+// deep call later doesn't fault in a fresh page
+#define REALTIME_STACK_PREFAULT (64 * 1024)
+
+// What realtimeLockMemory managed
+enum realtime_lock
+{
+  REALTIME_LOCKED_NOTHING,
+  REALTIME_LOCKED_TRACKS,     // mlockall was refused, but every loop buffer is locked
+  REALTIME_LOCKED_ALL         // the whole process, including anything mapped later
+};
+
+// --realtime: keep the audio path out of the page-fault and scheduler paths.
+// Locks memory (everything if RLIMIT_MEMLOCK allows, otherwise just the loop
+// buffers, which are already prefaulted), checks that SCHED_FIFO at
+// `priority` is allowed, and prints what it got. Call once every buffer is
+// allocated and before any device starts.
+void realtimeSetup(struct tracks * tracks, int priority);
+
+enum realtime_lock realtimeLockMemory(struct tracks * tracks);
+// 0 if a thread may run SCHED_FIFO at `priority`, otherwise the errno
+int realtimeProbe(int priority);
+// Move the calling thread to SCHED_FIFO at `priority` and prefault its stack.
+// Meant to run once, from the first callback on each audio thread.
+int realtimePromote(int priority);
+
+#endif
@@ -0,0 +1,88 @@
+#include "stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// single writer, so a relaxed load and store is all an increment needs
+static void bump(_Atomic uint32_t * counter, uint32_t amount) {
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+void statsInit(struct callback_stats * stats, const char * name, uint32_t sampleRate) {
+  memset(stats, 0, sizeof(*stats));
+  stats->name = name;
+  stats->sampleRate = sampleRate;
+}
+
+uint64_t statsNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void statsRestart(struct callback_stats * stats) {
+  stats->lastStartUs = 0;
+}
+
+uint64_t statsBegin(struct callback_stats * stats) {
+  uint64_t now = statsNow();
+
+  if (stats->lastStartUs != 0 && now - stats->lastStartUs > STATS_LATE_PERIODS * stats->lastPeriodUs) {
+    bump(&stats->late, 1);
+  }
+  stats->lastStartUs = now;
+  return now;
+}
+
+void statsEnd(struct callback_stats * stats, uint64_t start, uint32_t frameCount) {
+  uint32_t took = (uint32_t)(statsNow() - start);
+  uint64_t period = (uint64_t)frameCount * 1000000 / stats->sampleRate;
+  int bucket = period > 0 ? (int)(took * 10 / period) : STATS_BUCKETS - 1;
+
+  if (bucket >= STATS_BUCKETS) {
+    bucket = STATS_BUCKETS - 1;
+  }
+  stats->lastPeriodUs = period;
+  bump(&stats->histogram[bucket], 1);
+  bump(&stats->calls, 1);
+  atomic_store_explicit(&stats->totalUs, atomic_load_explicit(&stats->totalUs, memory_order_relaxed) + took, memory_order_relaxed);
+  if (took > period) {
+    bump(&stats->overruns, 1);
+  }
+  if (took > atomic_load_explicit(&stats->maxUs, memory_order_relaxed)) {
+    atomic_store_explicit(&stats->maxUs, took, memory_order_relaxed);
+  }
+}
+
+uint32_t statsGlitches(struct callback_stats * stats) {
+  return atomic_load_explicit(&stats->overruns, memory_order_relaxed) + atomic_load_explicit(&stats->late, memory_order_relaxed);
+}
+
+void statsPrint(struct callback_stats * stats) {
+  uint32_t calls = atomic_load_explicit(&stats->calls, memory_order_relaxed);
+  int realtime = atomic_load_explicit(&stats->realtime, memory_order_relaxed);
+
+  if (calls == 0) {
+    return;
+  }
+  printf("%s: %u callbacks, mean %uus, max %uus, %u over budget, %u xruns", stats->name, calls,
+         (uint32_t)(atomic_load_explicit(&stats->totalUs, memory_order_relaxed) / calls),
+         atomic_load_explicit(&stats->maxUs, memory_order_relaxed),
+         atomic_load_explicit(&stats->overruns, memory_order_relaxed),
+         atomic_load_explicit(&stats->late, memory_order_relaxed));
+  if (realtime > 0) {
+    printf(", SCHED_FIFO %d\n", realtime);
+  } else {
+    printf(", normal scheduling\n");
+  }
+  // one column per tenth of the period budget, labelled by where it starts
+  printf("  %% of period");
+  for (int i = 0; i < STATS_BUCKETS - 1; i++) {
+    printf(" %6d", i * 10);
+  }
+  printf(" %6s\n  callbacks  ", "110+");
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    printf(" %6u", atomic_load_explicit(&stats->histogram[i], memory_order_relaxed));
+  }
+  printf("\n");
+}
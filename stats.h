@@ -0,0 +1,51 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Each bucket is a tenth of the period; the last one is everything past 110%
+#define STATS_BUCKETS 12
+// A callback that starts this many periods after the one before it means the
+// device ran dry (or overflowed) in between
+#define STATS_LATE_PERIODS 2
+
+// Timing for one audio callback. Only that callback's thread writes here, so
+// every update is a plain load and store - no read-modify-write, no locks -
+// and the counters are 32 bits so they stay lock-free on the Pi's ARMv6. The
+// total time is the exception: 32 bits of microseconds run out after 71
+// minutes of callbacks. Anyone can print them at any time; a dump taken
+// mid-callback is at worst a count or two out.
+struct callback_stats
+{
+  const char * name;
+  uint32_t sampleRate;
+  _Atomic uint32_t calls;
+  _Atomic uint32_t overruns;            // took longer than the audio they handled lasts
+  _Atomic uint32_t late;                // xruns, going by the gap since the last callback
+  _Atomic uint64_t totalUs;
+  _Atomic uint32_t maxUs;
+  _Atomic uint32_t histogram[STATS_BUCKETS];   // duration as a share of the period
+  _Atomic int realtime;                 // SCHED_FIFO priority the thread runs at, 0 if it doesn't
+  uint64_t lastStartUs;                 // callback thread only, 0 until it runs after a (re)start
+  uint64_t lastPeriodUs;
+};
+
+void statsInit(struct callback_stats * stats, const char * name, uint32_t sampleRate);
+// CLOCK_MONOTONIC in microseconds
+uint64_t statsNow(void);
+
+// Call before starting the device, while its callback can't be running, so
+// the time it spent stopped isn't counted as an xrun
+void statsRestart(struct callback_stats * stats);
+
+// Bracket a callback: `start` is what statsBegin returned
+uint64_t statsBegin(struct callback_stats * stats);
+void statsEnd(struct callback_stats * stats, uint64_t start, uint32_t frameCount);
+
+// Print a summary, or nothing if the callback never ran
+void statsPrint(struct callback_stats * stats);
+// Overruns plus xruns - anything that may have been heard
+uint32_t statsGlitches(struct callback_stats * stats);
+
+#endif
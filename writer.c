@@ -0,0 +1,536 @@
+#include "writer.h"
+#include "archive.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+void wavWriterPush(struct wav_writer * writer, int track, ma_uint64 frame, const void * frames, ma_uint32 frameCount) {
+  ma_uint32 bytesPerFrame = ma_get_bytes_per_frame(writer->format, writer->channels);
+  const char * in = (const char *)frames;
+  unsigned tail = atomic_load_explicit(&writer->spanTail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&writer->spanHead, memory_order_acquire);
+  ma_uint32 pushed = 0;
+
+  // no room for the label means no room for the frames
+  if (tail - head == WRITER_SPANS) {
+    atomic_fetch_add_explicit(&writer->droppedFrames, frameCount, memory_order_relaxed);
+    return;
+  }
+
+  // the ring may wrap, so this takes at most two passes
+  while (pushed < frameCount) {
+    ma_uint32 chunk = frameCount - pushed;
+    void * out;
+    if (ma_pcm_rb_acquire_write(&writer->ring, &chunk, &out) != MA_SUCCESS || chunk == 0) {
+      break;
+    }
+    memcpy(out, in, (size_t)chunk * bytesPerFrame);
+    ma_pcm_rb_commit_write(&writer->ring, chunk);
+    in += (size_t)chunk * bytesPerFrame;
+    pushed += chunk;
+  }
+
+  if (pushed > 0) {
+    struct writer_span span = { track, pushed, frame };
+    writer->spans[tail & (WRITER_SPANS - 1)] = span;
+    atomic_store_explicit(&writer->spanTail, tail + 1, memory_order_release);
+  }
+  if (pushed < frameCount) {
+    atomic_fetch_add_explicit(&writer->droppedFrames, frameCount - pushed, memory_order_relaxed);
+  }
+}
+
+static ma_uint64 nowUs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ma_uint64)ts.tv_sec * 1000000 + (ma_uint64)ts.tv_nsec / 1000;
+}
+
+static void put16(unsigned char * at, ma_uint32 value) {
+  at[0] = (unsigned char)value;
+  at[1] = (unsigned char)(value >> 8);
+}
+
+static void put32(unsigned char * at, ma_uint32 value) {
+  put16(at, value);
+  put16(at + 2, value >> 16);
+}
+
+static void put64(unsigned char * at, ma_uint64 value) {
+  put32(at, (ma_uint32)value);
+  put32(at + 4, (ma_uint32)(value >> 32));
+}
+
+// RIFF (or RF64), a JUNK or ds64 chunk, fmt, a JUNK chunk padding out to
+// WRITER_HEADER_BYTES, then the data chunk header
+static bool writeHeader(struct wav_writer * writer, struct writer_take * take, ma_uint64 dataBytes) {
+  unsigned char header[WRITER_HEADER_BYTES];
+  ma_uint32 bytesPerSample = ma_get_bytes_per_sample(writer->format);
+  ma_uint64 riffBytes = WRITER_HEADER_BYTES - 8 + dataBytes;
+  bool rf64 = riffBytes > 0xFFFFFFFF;
+
+  memset(header, 0, sizeof(header));
+  memcpy(header, rf64 ? "RF64" : "RIFF", 4);
+  put32(header + 4, rf64 ? 0xFFFFFFFF : (ma_uint32)riffBytes);
+  memcpy(header + 8, "WAVE", 4);
+
+  memcpy(header + 12, rf64 ? "ds64" : "JUNK", 4);
+  put32(header + 16, 28);
+  if (rf64) {
+    put64(header + 20, riffBytes);
+    put64(header + 28, dataBytes);
+    put64(header + 36, dataBytes / (bytesPerSample * writer->channels));
+  }
+
+  memcpy(header + 48, "fmt ", 4);
+  put32(header + 52, 16);
+  put16(header + 56, writer->format == ma_format_f32 ? 3 : 1);    // IEEE float or PCM
+  put16(header + 58, writer->channels);
+  put32(header + 60, writer->sampleRate);
+  put32(header + 64, writer->sampleRate * bytesPerSample * writer->channels);
+  put16(header + 68, bytesPerSample * writer->channels);
+  put16(header + 70, bytesPerSample * 8);
+
+  memcpy(header + 72, "JUNK", 4);
+  put32(header + 76, WRITER_HEADER_BYTES - 72 - 8 - 8);
+
+  memcpy(header + WRITER_HEADER_BYTES - 8, "data", 4);
+  put32(header + WRITER_HEADER_BYTES - 4, rf64 ? 0xFFFFFFFF : (ma_uint32)dataBytes);
+
+  return pwrite(take->fd, header, sizeof(header), 0) == (ssize_t)sizeof(header);
+}
+
+// Write the block as it stands at its place in the file. A partial block
+// is written again, from the same offset, once it fills up.
+static bool writeBlock(struct writer_take * take) {
+  size_t written = 0;
+
+  while (written < take->blockFill) {
+    ssize_t count = pwrite(take->fd, take->block + written, take->blockFill - written, (off_t)(take->blockOffset + written));
+    if (count <= 0) {
+      return false;
+    }
+    written += (size_t)count;
+  }
+  return true;
+}
+
+// Get everything so far onto the disk, then point the header at it, so the
+// header never claims audio that isn't there
+static void syncTake(struct wav_writer * writer, struct writer_take * take) {
+  ma_uint64 dataBytes = take->blockOffset + take->blockFill - WRITER_HEADER_BYTES;
+
+  take->lastSyncUs = nowUs();
+  if (dataBytes == take->syncedBytes) {
+    return;
+  }
+  if (!writeBlock(take) || fdatasync(take->fd) != 0 || !writeHeader(writer, take, dataBytes)) {
+    printf("Failed to write the take to disk.\n");
+    return;
+  }
+  take->syncedBytes = dataBytes;
+}
+
+static void append(struct writer_take * take, const void * frames, size_t bytes) {
+  const unsigned char * in = (const unsigned char *)frames;
+
+  while (bytes > 0) {
+    size_t chunk = WRITER_BLOCK_BYTES - take->blockFill;
+    if (chunk > bytes) {
+      chunk = bytes;
+    }
+    memcpy(take->block + take->blockFill, in, chunk);
+    take->blockFill += chunk;
+    in += chunk;
+    bytes -= chunk;
+    if (take->blockFill == WRITER_BLOCK_BYTES) {
+      if (!writeBlock(take)) {
+        printf("Failed to write the take to disk.\n");
+      }
+      take->blockOffset += WRITER_BLOCK_BYTES;
+      take->blockFill = 0;
+    }
+  }
+}
+
+// The take open on `track`, NULL if there isn't one
+static struct writer_take * takeOn(struct wav_writer * writer, int track) {
+  for (int i = 0; i < WRITER_TAKES; i++) {
+    if (writer->takes[i].isOpen && writer->takes[i].track == track) {
+      return &writer->takes[i];
+    }
+  }
+  return NULL;
+}
+
+static bool anyOpen(struct wav_writer * writer) {
+  for (int i = 0; i < WRITER_TAKES; i++) {
+    if (writer->takes[i].isOpen) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Move whatever is in the ring to the take, a span at a time. Unless `flush`
+// is set we only copy once a full batch is waiting, to keep the thread
+// mostly asleep.
+static void drain(struct wav_writer * writer, bool flush) {
+  ma_uint32 bytesPerFrame = ma_get_bytes_per_frame(writer->format, writer->channels);
+  ma_uint32 available = ma_pcm_rb_available_read(&writer->ring);
+  unsigned head = atomic_load_explicit(&writer->spanHead, memory_order_relaxed);
+
+  // with no take open (the tail of one that just closed) everything is dropped right away
+  if (!flush && anyOpen(writer) && available < writer->batchFrames) {
+    return;
+  }
+
+  // a span is published after its frames, so every span seen here is all in the ring
+  while (head != atomic_load_explicit(&writer->spanTail, memory_order_acquire)) {
+    struct writer_span span = writer->spans[head & (WRITER_SPANS - 1)];
+    // frames captured for a track with no take open go nowhere
+    struct writer_take * take = takeOn(writer, span.track);
+
+    if (take != NULL && !take->started) {
+      take->startFrame = span.frame;
+      take->started = true;
+    }
+    while (span.frames > 0) {
+      ma_uint32 chunk = span.frames;
+      void * in;
+      if (ma_pcm_rb_acquire_read(&writer->ring, &chunk, &in) != MA_SUCCESS || chunk == 0) {
+        break;
+      }
+      if (take != NULL) {
+        append(take, in, (size_t)chunk * bytesPerFrame);
+      }
+      ma_pcm_rb_commit_read(&writer->ring, chunk);
+      span.frames -= chunk;
+    }
+    head++;
+    atomic_store_explicit(&writer->spanHead, head, memory_order_release);
+  }
+
+  for (int i = 0; i < WRITER_TAKES; i++) {
+    struct writer_take * take = &writer->takes[i];
+    if (take->isOpen && nowUs() - take->lastSyncUs >= WRITER_SYNC_MS * 1000ull) {
+      syncTake(writer, take);
+    }
+  }
+}
+
+// Name the next take's file and open it with a header for an empty take,
+// so even a take that dies straight away is a valid file
+static bool openTake(struct wav_writer * writer, struct writer_take * take, int track) {
+  char path[WRITER_PATH_MAX + 64];
+  time_t now = time(NULL);
+  struct tm local;
+
+  localtime_r(&now, &local);
+  snprintf(take->name, sizeof(take->name), "take-%03u-track%d-%02d%02d%02d.wav",
+           writer->takeCount + 1, track + 1, local.tm_hour, local.tm_min, local.tm_sec);
+  snprintf(path, sizeof(path), "%s/%s", writer->sessionDir, take->name);
+  take->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (take->fd < 0) {
+    return false;
+  }
+  if (!writeHeader(writer, take, 0)) {
+    close(take->fd);
+    return false;
+  }
+  take->blockOffset = WRITER_HEADER_BYTES;
+  take->blockFill   = 0;
+  take->syncedBytes = 0;
+  take->lastSyncUs  = nowUs();
+  take->number      = ++writer->takeCount;
+  take->track       = track;
+  take->started     = false;
+  take->startFrame  = 0;
+  return true;
+}
+
+static void closeTake(struct wav_writer * writer, struct writer_take * take) {
+  char line[256];
+
+  syncTake(writer, take);
+  close(take->fd);
+  take->isOpen = false;
+  take->closeRequested = false;
+
+  // what's listed is what's on disk
+  int length = snprintf(line, sizeof(line), "%u\t%d\t%llu\t%llu\t%s\t%u\t%u\t%s\n",
+                        take->number, take->track + 1, (unsigned long long)take->startFrame,
+                        (unsigned long long)(take->syncedBytes / ma_get_bytes_per_frame(writer->format, writer->channels)),
+                        writer->format == ma_format_s16 ? "s16" : "f32", writer->channels, writer->sampleRate, take->name);
+  if (writer->indexFd >= 0 && (write(writer->indexFd, line, (size_t)length) != length || fdatasync(writer->indexFd) != 0)) {
+    printf("Failed to add %s to the session index.\n", take->name);
+  }
+  if (writer->archive != NULL) {
+    char path[WRITER_PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/%s", writer->sessionDir, take->name);
+    archiveAdd(writer->archive, path);
+  }
+}
+
+static bool anyCloseRequested(struct wav_writer * writer) {
+  for (int i = 0; i < WRITER_TAKES; i++) {
+    if (writer->takes[i].closeRequested) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void * writerThread(void * arg) {
+  struct wav_writer * writer = (struct wav_writer *)arg;
+  pthread_mutex_lock(&writer->lock);
+  while (writer->running) {
+    if (writer->openTrack >= 0) {
+      // wavWriterOpen made sure there's a free one
+      struct writer_take * take = writer->takes;
+      while (take->isOpen) {
+        take++;
+      }
+      writer->openFailed = !openTake(writer, take, writer->openTrack);
+      if (writer->openFailed) {
+        printf("Failed to initialize output file %s/%s.\n", writer->sessionDir, take->name);
+      } else {
+        take->isOpen = true;
+      }
+      writer->openTrack = -1;
+      pthread_cond_broadcast(&writer->wake);
+    }
+
+    // the takes asked for now are the ones closed after this drain - anything
+    // pushed before the request is in the ring by now
+    bool closing[WRITER_TAKES];
+    bool anyClosing = false;
+    for (int i = 0; i < WRITER_TAKES; i++) {
+      closing[i] = writer->takes[i].closeRequested;
+      anyClosing = anyClosing || closing[i];
+    }
+    pthread_mutex_unlock(&writer->lock);
+    drain(writer, anyClosing);
+    pthread_mutex_lock(&writer->lock);
+
+    if (anyClosing) {
+      for (int i = 0; i < WRITER_TAKES; i++) {
+        if (closing[i]) {
+          closeTake(writer, &writer->takes[i]);
+        }
+      }
+      pthread_cond_broadcast(&writer->wake);
+    }
+
+    // the capture callback can't signal us without risking a block, so poll
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += WRITER_POLL_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    if (writer->running && writer->openTrack < 0 && !anyCloseRequested(writer)) {
+      pthread_cond_timedwait(&writer->wake, &writer->lock, &deadline);
+    }
+  }
+
+  if (anyOpen(writer)) {
+    pthread_mutex_unlock(&writer->lock);
+    drain(writer, true);
+    pthread_mutex_lock(&writer->lock);
+    for (int i = 0; i < WRITER_TAKES; i++) {
+      if (writer->takes[i].isOpen) {
+        closeTake(writer, &writer->takes[i]);
+      }
+    }
+  }
+  pthread_mutex_unlock(&writer->lock);
+  return NULL;
+}
+
+ma_result wavWriterInit(struct wav_writer * writer, ma_format format, ma_uint32 channels, ma_uint32 sampleRate, const ma_allocation_callbacks * allocationCallbacks) {
+  ma_result result;
+
+  memset(writer, 0, sizeof(*writer));
+  writer->format      = format;
+  writer->channels    = channels;
+  writer->sampleRate  = sampleRate;
+  writer->batchFrames = sampleRate * WRITER_BATCH_MS / 1000;
+  writer->indexFd     = -1;
+  writer->openTrack   = -1;
+  snprintf(writer->sessionDir, sizeof(writer->sessionDir), ".");
+  if (allocationCallbacks != NULL) {
+    writer->allocationCallbacks = *allocationCallbacks;
+  }
+
+  result = ma_pcm_rb_init(format, channels, sampleRate * WRITER_RING_SECONDS, NULL, allocationCallbacks, &writer->ring);
+  if (result != MA_SUCCESS) {
+    return result;
+  }
+  writer->spans = ma_malloc(WRITER_SPANS * sizeof(struct writer_span), allocationCallbacks);
+  writer->blocks = ma_aligned_malloc((size_t)WRITER_TAKES * WRITER_BLOCK_BYTES, WRITER_HEADER_BYTES, allocationCallbacks);
+  if (writer->spans == NULL || writer->blocks == NULL) {
+    ma_free(writer->spans, allocationCallbacks);
+    ma_aligned_free(writer->blocks, allocationCallbacks);
+    ma_pcm_rb_uninit(&writer->ring);
+    return MA_OUT_OF_MEMORY;
+  }
+  for (int i = 0; i < WRITER_TAKES; i++) {
+    writer->takes[i].fd    = -1;
+    writer->takes[i].block = writer->blocks + (size_t)i * WRITER_BLOCK_BYTES;
+  }
+
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->wake, NULL);
+  writer->running = true;
+  if (pthread_create(&writer->thread, NULL, writerThread, writer) != 0) {
+    pthread_cond_destroy(&writer->wake);
+    pthread_mutex_destroy(&writer->lock);
+    ma_free(writer->spans, allocationCallbacks);
+    ma_aligned_free(writer->blocks, allocationCallbacks);
+    ma_pcm_rb_uninit(&writer->ring);
+    return MA_ERROR;
+  }
+  return MA_SUCCESS;
+}
+
+size_t wavWriterBytes(ma_format format, ma_uint32 channels, ma_uint32 sampleRate) {
+  size_t ring   = (size_t)sampleRate * WRITER_RING_SECONDS * ma_get_bytes_per_frame(format, channels);
+  size_t spans  = WRITER_SPANS * sizeof(struct writer_span);
+  size_t blocks = (size_t)WRITER_TAKES * WRITER_BLOCK_BYTES;
+  return ring + spans + blocks + 64 * 1024;
+}
+
+void wavWriterUninit(struct wav_writer * writer) {
+  pthread_mutex_lock(&writer->lock);
+  writer->running = false;
+  pthread_cond_broadcast(&writer->wake);
+  pthread_mutex_unlock(&writer->lock);
+  pthread_join(writer->thread, NULL);
+
+  pthread_cond_destroy(&writer->wake);
+  pthread_mutex_destroy(&writer->lock);
+  // a zeroed copy means there were none, and miniaudio wants NULL for that
+  ma_free(writer->spans, writer->allocationCallbacks.onFree != NULL ? &writer->allocationCallbacks : NULL);
+  ma_aligned_free(writer->blocks, writer->allocationCallbacks.onFree != NULL ? &writer->allocationCallbacks : NULL);
+  ma_pcm_rb_uninit(&writer->ring);
+  if (writer->indexFd >= 0) {
+    close(writer->indexFd);
+  }
+}
+
+// mkdir -p
+static bool makeDirectories(char * path) {
+  for (char * slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    bool made = mkdir(path, 0755) == 0 || errno == EEXIST;
+    *slash = '/';
+    if (!made) {
+      return false;
+    }
+  }
+  return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+ma_result wavWriterSession(struct wav_writer * writer, const char * dir) {
+  char path[WRITER_PATH_MAX + 16];
+  char line[256];
+
+  if (dir == NULL) {
+    time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    snprintf(writer->sessionDir, sizeof(writer->sessionDir), "%s/%04d-%02d-%02d_%02d-%02d-%02d", WRITER_SESSIONS_DIR,
+             local.tm_year + 1900, local.tm_mon + 1, local.tm_mday, local.tm_hour, local.tm_min, local.tm_sec);
+  } else {
+    snprintf(writer->sessionDir, sizeof(writer->sessionDir), "%s", dir);
+  }
+  if (!makeDirectories(writer->sessionDir)) {
+    return MA_ERROR;
+  }
+
+  // carry on numbering where an existing session left off
+  snprintf(path, sizeof(path), "%s/%s", writer->sessionDir, WRITER_INDEX_FILE);
+  FILE * index = fopen(path, "r");
+  writer->takeCount = 0;
+  if (index != NULL) {
+    while (fgets(line, sizeof(line), index) != NULL) {
+      if (line[0] != '#') {
+        writer->takeCount++;
+      }
+    }
+    fclose(index);
+  }
+  writer->indexFd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (writer->indexFd < 0) {
+    return MA_ERROR;
+  }
+  if (writer->takeCount == 0 && lseek(writer->indexFd, 0, SEEK_END) == 0) {
+    const char * heading = "# take\ttrack\tstart\tframes\tformat\tchannels\trate\tfile\n";
+    if (write(writer->indexFd, heading, strlen(heading)) < 0) {
+      return MA_ERROR;
+    }
+  }
+  return MA_SUCCESS;
+}
+
+// Whether a take can be opened on `track` now. A take that's only waiting
+// to be closed is waited for.
+static bool roomFor(struct wav_writer * writer, int track, bool * wait) {
+  int open = 0;
+
+  *wait = false;
+  for (int i = 0; i < WRITER_TAKES; i++) {
+    struct writer_take * take = &writer->takes[i];
+    if (take->isOpen) {
+      open++;
+      *wait = *wait || take->closeRequested;
+      if (take->track == track) {
+        *wait = take->closeRequested;
+        return false;
+      }
+    }
+  }
+  return open < WRITER_TAKES;
+}
+
+ma_result wavWriterOpen(struct wav_writer * writer, int track) {
+  ma_result result;
+  bool wait;
+
+  pthread_mutex_lock(&writer->lock);
+  while (!roomFor(writer, track, &wait)) {
+    if (!wait) {
+      pthread_mutex_unlock(&writer->lock);
+      return MA_BUSY;
+    }
+    pthread_cond_wait(&writer->wake, &writer->lock);
+  }
+  // dropped frames are counted from when the first of the open takes started
+  if (!anyOpen(writer)) {
+    atomic_store(&writer->droppedFrames, 0);
+  }
+  writer->openTrack = track;
+  pthread_cond_broadcast(&writer->wake);
+  while (writer->openTrack >= 0) {
+    pthread_cond_wait(&writer->wake, &writer->lock);
+  }
+  result = writer->openFailed ? MA_ERROR : MA_SUCCESS;
+  pthread_mutex_unlock(&writer->lock);
+  return result;
+}
+
+void wavWriterClose(struct wav_writer * writer, int track) {
+  pthread_mutex_lock(&writer->lock);
+  struct writer_take * take = takeOn(writer, track);
+  if (take != NULL) {
+    take->closeRequested = true;
+    pthread_cond_broadcast(&writer->wake);
+  }
+  pthread_mutex_unlock(&writer->lock);
+}
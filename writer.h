@@ -0,0 +1,138 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include "miniaudio.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// How much audio the hand-off ring can absorb while the disk is stalled
+#define WRITER_RING_SECONDS 4
+// Pushes the ring can hold the labels for - one per callback per recording
+// track. Must be a power of two.
+#define WRITER_SPANS 8192
+// The writer thread waits for at least this much audio before writing
+#define WRITER_BATCH_MS 100
+#define WRITER_POLL_MS 20
+// Takes go to disk a block at a time, every write starting on a block
+// boundary. The header is padded out to one alignment unit so the audio
+// data that follows it lines up too.
+#define WRITER_BLOCK_BYTES (128 * 1024)
+#define WRITER_HEADER_BYTES 4096
+// How often the take is synced and its header brought up to date, which is
+// as much as a power cut can lose
+#define WRITER_SYNC_MS 1000
+// Takes that can be open at once: quantized, a take runs on past its
+// boundary while the next one has already started
+#define WRITER_TAKES 4
+// Where sessions go when no directory is given, and the take list in each
+#define WRITER_SESSIONS_DIR "sessions"
+#define WRITER_INDEX_FILE "index.tsv"
+#define WRITER_PATH_MAX 512
+
+struct archive;
+
+// What one push from the capture callback was: which track's take the
+// frames belong to, and where they start on the capture side's clock
+struct writer_span
+{
+  int track;
+  ma_uint32 frames;
+  ma_uint64 frame;
+};
+
+// One take's file, owned by the writer thread once it's open
+struct writer_take
+{
+  int track;
+  bool isOpen;
+  bool closeRequested;
+  int fd;                      // the take's file, written with no stdio buffer
+  unsigned char * block;       // WRITER_BLOCK_BYTES, aligned to WRITER_HEADER_BYTES
+  size_t blockFill;
+  ma_uint64 blockOffset;       // where `block` goes in the file
+  ma_uint64 syncedBytes;       // audio known to be on disk, and what the header says
+  ma_uint64 lastSyncUs;
+  ma_uint32 number;            // its line in the index
+  bool started;                // its first frames have arrived
+  ma_uint64 startFrame;
+  char name[64];               // within sessionDir
+};
+
+// Streams captured frames to a WAV file on a background thread. The capture
+// callback pushes into a lock-free single-producer/single-consumer ring and
+// the writer thread drains it into an aligned block, written out whole with
+// pwrite(2), so the audio thread never touches the filesystem.
+//
+// The header is rewritten with the sizes of whatever is safely on disk once
+// a second, so a take cut off by a crash or power loss still opens, minus
+// at most the last second. Takes past 4GB switch the header to RF64; the
+// space its ds64 chunk needs is held by a JUNK chunk until then.
+//
+// Every push is labelled with its track and its first frame, in a span
+// queue that runs alongside the ring. Up to WRITER_TAKES takes can be open,
+// one per track, and each span goes to the take open on its track, or
+// nowhere. A take's start frame is the one its first push carried, so two
+// takes that overlap each get exactly their own frames.
+//
+// Each take gets its own numbered, timestamped file in the session
+// directory. As a take closes, the writer thread adds a line for it to the
+// session's index: take, track, start frame (frames captured since the
+// looper started), length in frames, format, channels, rate and file name,
+// then hands the take to `archive` if one is set.
+struct wav_writer
+{
+  ma_format format;
+  ma_uint32 channels;
+  ma_uint32 sampleRate;
+  ma_pcm_rb ring;
+  struct writer_span * spans;  // WRITER_SPANS, in the same order as the ring
+  _Atomic unsigned spanHead;   // next span to read, only moved by the writer thread
+  _Atomic unsigned spanTail;   // next span to write, only moved by the capture callback
+  ma_uint32 batchFrames;
+
+  // frames the capture callback could not fit in the ring
+  _Atomic ma_uint64 droppedFrames;
+
+  // everything below is shared between the control and writer threads only
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  bool running;
+  int openTrack;               // set by wavWriterOpen, consumed by the writer thread, -1 when idle
+  bool openFailed;
+  struct writer_take takes[WRITER_TAKES];
+  unsigned char * blocks;      // every take's block, in one allocation
+
+  // the session, set up before the first take
+  char sessionDir[WRITER_PATH_MAX];
+  int indexFd;
+  ma_uint32 takeCount;
+  struct archive * archive;    // compresses finished takes, NULL to keep them as WAV
+  ma_allocation_callbacks allocationCallbacks;
+};
+
+// `allocationCallbacks` (may be NULL) is used for the ring, the spans and the write blocks
+ma_result wavWriterInit(struct wav_writer * writer, ma_format format, ma_uint32 channels, ma_uint32 sampleRate, const ma_allocation_callbacks * allocationCallbacks);
+void wavWriterUninit(struct wav_writer * writer);
+// The most wavWriterInit takes from its allocation callbacks at this format,
+// with room for alignment and an allocator's own bookkeeping. The ring is
+// most of it, and grows with the rate and channels.
+size_t wavWriterBytes(ma_format format, ma_uint32 channels, ma_uint32 sampleRate);
+
+// Start writing takes to `dir`, or to a new timestamped directory under
+// WRITER_SESSIONS_DIR if it's NULL. An existing session is added to. Call
+// before the first take.
+ma_result wavWriterSession(struct wav_writer * writer, const char * dir);
+// Start a new take on `track`. Blocks until its file is open. Takes on other
+// tracks carry on. Returns MA_BUSY if WRITER_TAKES are open already, or one
+// is open on `track`.
+ma_result wavWriterOpen(struct wav_writer * writer, int track);
+// Finish the take on `track` once everything pushed so far is on disk. Does not block.
+void wavWriterClose(struct wav_writer * writer, int track);
+
+// real-time safe: called from the capture callback. `frame` is the first
+// frame's number on the capture side's clock.
+void wavWriterPush(struct wav_writer * writer, int track, ma_uint64 frame, const void * frames, ma_uint32 frameCount);
+
+#endif